@@ -0,0 +1,422 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "bufferops.h"
+#include "arith.h"
+
+// Asymmetric numeral system coders for the static per-block model. The symbol counts, and the bit shift realigning
+// the input, come from arith::CodecProbabilityTable; they are scaled to a power-of-two total so that coding needs
+// no division in the decoder. Both variants share one layout:
+//
+//  uint64_t Size  uint16_t Frequencies[256]  uint8_t Shift  uint8_t Lanes  uint8_t Residual  payload
+//
+// rANS codes with 31-bit states renormalized 16 bits at a time. tANS codes from a state table of 1<<TansTableLog
+// entries and emits whole bit fields. Either interleaves 1, 2, 4 or 8 independent states (Lanes) over one stream.
+// Both encoders run over the symbols last to first, so both payloads are read back to front.
+namespace ans {
+    enum AnsVariant : uint8_t {RansVariant = 0u, TansVariant = 1u};
+
+    const uint64_t HeaderLength = 8u + 256u*2u;
+    const uint64_t PayloadOffset = HeaderLength + 3u;
+    const uint8_t MaxLanes = 8u;
+    const uint8_t DefaultLanes = 4u;
+    const uint8_t RansScaleBits = 14u;
+    const uint32_t RansLowerBound = 1u<<15u;
+    const uint8_t TansTableLog = 12u;
+    const uint32_t TansTableSize = 1u<<TansTableLog;
+
+    inline uint8_t ScaleBits(AnsVariant Variant) {
+        return Variant == TansVariant ? TansTableLog : RansScaleBits;
+    }
+
+    inline uint8_t HighBit(uint32_t Value) {
+        return uint8_t(31 - __builtin_clz(Value));
+    }
+
+    // Reads the frequency header and checks that it sums to 1<<Scale, or to 0 when no symbols were coded
+    inline void DecodeFrequencies(buffer::ByteView Buffer, uint8_t Scale, uint64_t SymbolCount, uint32_t* Frequencies) {
+        uint32_t sum = 0;
+        for (uint16_t i = 0; i < 256; i++) {
+            uint16_t frequency;
+            buffer::DecodeTypeFromBuffer<uint16_t>(Buffer, 8u + 2u*i, &frequency);
+            Frequencies[i] = frequency;
+            sum += frequency;
+        }
+        if (sum != (SymbolCount == 0 ? 0u : 1u<<Scale)) {
+            throw std::runtime_error("Bad Frequency Table In Compression Stream.");
+        }
+    }
+
+    // Division-free rANS encoding of one symbol: the quotient by its frequency is a multiply by a fixed-point
+    // reciprocal and a shift
+    struct RansEncodeSymbol {
+        uint32_t Max;
+        uint32_t Reciprocal;
+        uint32_t Bias;
+        uint16_t Complement;
+        uint16_t Shift;
+
+        void Init(uint32_t Start, uint32_t Frequency) {
+            Max = ((RansLowerBound>>RansScaleBits)<<16u)*Frequency;
+            Complement = uint16_t((1u<<RansScaleBits) - Frequency);
+            if (Frequency < 2u) {
+                Reciprocal = ~0u;
+                Shift = 0u;
+                Bias = Start + (1u<<RansScaleBits) - 1u;
+            } else {
+                uint32_t shift = 0;
+                while (Frequency > (1u<<shift)) {
+                    shift++;
+                }
+                Reciprocal = uint32_t(((1ull<<(shift + 31u)) + Frequency - 1u)/Frequency);
+                Shift = uint16_t(shift - 1u);
+                Bias = Start;
+            }
+        }
+
+        // States stay below 1<<31, so one 16-bit word renormalizes them
+        void Encode(uint32_t& State, buffer::CodecByteStream& OutputBuffer) const {
+            if (State >= Max) {
+                OutputBuffer.WriteByte(uint8_t(State));
+                OutputBuffer.WriteByte(uint8_t(State>>8u));
+                State >>= 16u;
+            }
+            uint32_t quotient = uint32_t((uint64_t(State)*Reciprocal)>>32u)>>Shift;
+            State += Bias + quotient*Complement;
+        }
+    };
+
+    // Symbol i is coded with state i%Lanes. Lanes are independent dependency chains sharing one byte stream, so the
+    // CPU overlaps their multiplies and table lookups.
+    template<uint8_t Lanes>
+    void CompressRans(buffer::CodecBufferWrapper& Buffer, uint64_t SymbolCount, const uint32_t* Frequencies,
+                      buffer::CodecByteStream& OutputBuffer) {
+        RansEncodeSymbol symbols[256];
+        uint32_t start = 0;
+        for (uint16_t i = 0; i < 256; i++) {
+            symbols[i].Init(start, Frequencies[i]);
+            start += Frequencies[i];
+        }
+
+        uint32_t states[Lanes];
+        std::fill(states, states + Lanes, RansLowerBound);
+        for (uint64_t i = SymbolCount; i > 0; i--) {
+            symbols[Buffer[i-1u]].Encode(states[(i-1u)&(Lanes-1u)], OutputBuffer);
+        }
+
+        for (int lane = Lanes - 1; lane >= 0; lane--) {
+            for (uint8_t i = 0; i < 4; i++) {
+                OutputBuffer.WriteByte(uint8_t(states[lane]>>(8u*i)));
+            }
+        }
+    }
+
+    template<uint8_t Lanes>
+    void UncompressRans(buffer::ByteView InputBuffer, uint64_t SymbolCount, const uint32_t* Frequencies,
+                        unsigned char* Output) {
+        uint8_t slots[1u<<RansScaleBits];
+        uint32_t starts[256];
+        uint32_t start = 0;
+        for (uint16_t i = 0; i < 256; i++) {
+            memset(slots + start, i, Frequencies[i]);
+            starts[i] = start;
+            start += Frequencies[i];
+        }
+
+        const unsigned char* data = InputBuffer.Data();
+        uint64_t position = InputBuffer.Size();
+        auto read = [&]() -> uint32_t {
+            if (position == PayloadOffset) {
+                throw std::runtime_error("Truncated Compression Stream.");
+            }
+            return data[--position];
+        };
+
+        uint32_t states[Lanes];
+        for (uint8_t lane = 0; lane < Lanes; lane++) {
+            states[lane] = 0u;
+            for (uint8_t i = 0; i < 4; i++) {
+                states[lane] = (states[lane]<<8u)|read();
+            }
+        }
+
+        const uint32_t mask = (1u<<RansScaleBits) - 1u;
+        auto decode = [&](uint32_t& state) -> uint8_t {
+            uint32_t slot = state&mask;
+            uint8_t symbol = slots[slot];
+            state = Frequencies[symbol]*(state>>RansScaleBits) + slot - starts[symbol];
+            return symbol;
+        };
+
+        // A decoded state is at least 1, so one word always renormalizes it. While the stream holds a word per lane,
+        // a whole round of lanes runs without bounds checks or branches.
+        uint64_t i = 0;
+        for (; i + Lanes <= SymbolCount && position >= PayloadOffset + 2u*Lanes; i += Lanes) {
+#pragma GCC unroll 8
+            for (uint8_t lane = 0; lane < Lanes; lane++) {
+                Output[i + lane] = decode(states[lane]);
+                uint32_t word = (uint32_t(data[position-1u])<<8u)|data[position-2u];
+                bool renormalize = states[lane] < RansLowerBound;
+                states[lane] = renormalize ? (states[lane]<<16u)|word : states[lane];
+                position -= renormalize ? 2u : 0u;
+            }
+        }
+        for (; i < SymbolCount; i++) {
+            uint32_t& state = states[i&(Lanes-1u)];
+            Output[i] = decode(state);
+            if (state < RansLowerBound) {
+                state = (state<<8u)|read();
+                state = (state<<8u)|read();
+            }
+        }
+
+        for (uint8_t lane = 0; lane < Lanes; lane++) {
+            if (states[lane] != RansLowerBound) {
+                throw std::runtime_error("Corrupt Compression Stream.");
+            }
+        }
+        if (position != PayloadOffset) {
+            throw std::runtime_error("Corrupt Compression Stream.");
+        }
+    }
+
+    // Symbols are spread over the table with a stride coprime to its size, which interleaves them evenly
+    inline void SpreadSymbols(const uint32_t* Frequencies, uint8_t* Spread) {
+        const uint32_t step = (TansTableSize>>1u) + (TansTableSize>>3u) + 3u;
+        uint32_t position = 0;
+        for (uint16_t i = 0; i < 256; i++) {
+            for (uint32_t j = 0; j < Frequencies[i]; j++) {
+                Spread[position] = uint8_t(i);
+                position = (position + step)&(TansTableSize - 1u);
+            }
+        }
+    }
+
+    // Encoding from state x in [TansTableSize, 2*TansTableSize) emits the low (x + DeltaBits)>>16 bits of x and
+    // moves to the state stored at (x>>bits) + FindState
+    struct TansEncodeSymbol {
+        uint32_t DeltaBits;
+        int32_t FindState;
+    };
+
+    struct TansDecodeEntry {
+        uint16_t NextState;
+        uint8_t Symbol;
+        uint8_t Bits;
+    };
+
+    template<uint8_t Lanes>
+    void CompressTans(buffer::CodecBufferWrapper& Buffer, uint64_t SymbolCount, const uint32_t* Frequencies,
+                      buffer::CodecByteStream& OutputBuffer) {
+        uint8_t spread[TansTableSize];
+        uint16_t table[TansTableSize];
+        uint32_t next[256];
+        TansEncodeSymbol symbols[256];
+
+        uint32_t total = 0;
+        for (uint16_t i = 0; i < 256; i++) {
+            uint32_t frequency = Frequencies[i];
+            next[i] = total;
+            if (frequency == 1u) {
+                symbols[i].DeltaBits = (uint32_t(TansTableLog)<<16u) - TansTableSize;
+                symbols[i].FindState = int32_t(total) - 1;
+            } else if (frequency > 1u) {
+                uint32_t maxBits = TansTableLog - HighBit(frequency - 1u);
+                symbols[i].DeltaBits = (maxBits<<16u) - (frequency<<maxBits);
+                symbols[i].FindState = int32_t(total) - int32_t(frequency);
+            }
+            total += frequency;
+        }
+
+        if (total != 0) {
+            SpreadSymbols(Frequencies, spread);
+            for (uint32_t i = 0; i < TansTableSize; i++) {
+                table[next[spread[i]]++] = uint16_t(TansTableSize + i);
+            }
+        }
+
+        uint32_t states[Lanes];
+        std::fill(states, states + Lanes, TansTableSize);
+        for (uint64_t i = SymbolCount; i > 0; i--) {
+            uint32_t& state = states[(i-1u)&(Lanes-1u)];
+            const TansEncodeSymbol& symbol = symbols[Buffer[i-1u]];
+            uint8_t bits = uint8_t((state + symbol.DeltaBits)>>16u);
+            if (bits != 0) {
+                OutputBuffer.WriteBits(state&((1u<<bits) - 1u), bits);
+            }
+            state = table[int32_t(state>>bits) + symbol.FindState];
+        }
+
+        // The final states, then a 1 bit marking where the stream ends ahead of the zero padding
+        for (int lane = Lanes - 1; lane >= 0; lane--) {
+            OutputBuffer.WriteBits(states[lane] - TansTableSize, TansTableLog);
+        }
+        OutputBuffer.WriteBit(1u);
+    }
+
+    template<uint8_t Lanes>
+    void UncompressTans(buffer::ByteView InputBuffer, uint64_t SymbolCount, const uint32_t* Frequencies,
+                        unsigned char* Output) {
+        uint8_t spread[TansTableSize];
+        TansDecodeEntry table[TansTableSize];
+        uint32_t next[256];
+
+        if (SymbolCount != 0) {
+            std::copy(Frequencies, Frequencies + 256, next);
+            SpreadSymbols(Frequencies, spread);
+            for (uint32_t i = 0; i < TansTableSize; i++) {
+                uint8_t symbol = spread[i];
+                uint32_t state = next[symbol]++;
+                uint8_t bits = uint8_t(TansTableLog - HighBit(state));
+                table[i] = {uint16_t((state<<bits) - TansTableSize), symbol, bits};
+            }
+        }
+
+        buffer::CodecReverseBitReader Bits(InputBuffer, PayloadOffset);
+        Bits.Refill();
+        uint8_t last = uint8_t(Bits.Peek(8u));
+        if (last == 0u) {
+            throw std::runtime_error("Corrupt Compression Stream.");
+        }
+        Bits.Consume(uint8_t(__builtin_ctz(last) + 1));
+
+        uint32_t states[Lanes];
+        for (uint8_t lane = 0; lane < Lanes; lane++) {
+            Bits.Refill();
+            states[lane] = uint32_t(Bits.Peek(TansTableLog));
+            Bits.Consume(TansTableLog);
+        }
+
+        auto decode = [&](uint32_t& state) -> uint8_t {
+            const TansDecodeEntry& entry = table[state];
+            state = entry.NextState + uint32_t(Bits.Peek(entry.Bits));
+            Bits.Consume(entry.Bits);
+            return entry.Symbol;
+        };
+
+        // A refill holds at least 57 bits, enough for four symbols of at most TansTableLog bits each
+        uint64_t i = 0;
+        for (; i + Lanes <= SymbolCount; i += Lanes) {
+#pragma GCC unroll 8
+            for (uint8_t lane = 0; lane < Lanes; lane++) {
+                if (lane%4u == 0) {
+                    Bits.Refill();
+                }
+                Output[i + lane] = decode(states[lane]);
+            }
+        }
+        for (; i < SymbolCount; i++) {
+            Bits.Refill();
+            Output[i] = decode(states[i&(Lanes-1u)]);
+        }
+
+        for (uint8_t lane = 0; lane < Lanes; lane++) {
+            if (states[lane] != 0) {
+                throw std::runtime_error("Corrupt Compression Stream.");
+            }
+        }
+        if (Bits.Remaining() != 0) {
+            throw std::runtime_error("Corrupt Compression Stream.");
+        }
+    }
+
+    typedef void (*LaneEncoder)(buffer::CodecBufferWrapper&, uint64_t, const uint32_t*, buffer::CodecByteStream&);
+    typedef void (*LaneDecoder)(buffer::ByteView, uint64_t, const uint32_t*, unsigned char*);
+
+    // Index of a lane count of 1, 2, 4 or 8 into the coder tables below
+    inline uint8_t LaneIndex(uint8_t Lanes) {
+        if (Lanes == 0 || Lanes > MaxLanes || (Lanes&(Lanes - 1u)) != 0) {
+            throw std::runtime_error("Bad Lane Count In Compression Stream.");
+        }
+        return HighBit(Lanes);
+    }
+
+    inline LaneEncoder SelectEncoder(AnsVariant Variant, uint8_t Lanes) {
+        static const LaneEncoder rans[] = {CompressRans<1>, CompressRans<2>, CompressRans<4>, CompressRans<8>};
+        static const LaneEncoder tans[] = {CompressTans<1>, CompressTans<2>, CompressTans<4>, CompressTans<8>};
+        return (Variant == TansVariant ? tans : rans)[LaneIndex(Lanes)];
+    }
+
+    inline LaneDecoder SelectDecoder(AnsVariant Variant, uint8_t Lanes) {
+        static const LaneDecoder rans[] = {UncompressRans<1>, UncompressRans<2>, UncompressRans<4>, UncompressRans<8>};
+        static const LaneDecoder tans[] = {UncompressTans<1>, UncompressTans<2>, UncompressTans<4>, UncompressTans<8>};
+        return (Variant == TansVariant ? tans : rans)[LaneIndex(Lanes)];
+    }
+
+    // Buffer Compression/Decompression API. CompressedBuffer is created with a base length of HeaderLength. A non-zero
+    // SampleSize estimates the model from a sample, as in arith::CodecProbabilityTable::GenerateTable. Stats, when
+    // given, is added the time spent building or reading the frequencies; the coding tables count as coding.
+    inline CodecStatusCode CompressBuffer(buffer::ByteView UncompressedBuffer,
+                                          buffer::CodecByteStream& CompressedBuffer,
+                                          AnsVariant Variant = RansVariant,
+                                          uint8_t Lanes = DefaultLanes,
+                                          uint64_t SampleSize = 0,
+                                          stats::CoderStats* Stats = nullptr) {
+        LaneEncoder encode = SelectEncoder(Variant, Lanes);
+        arith::CodecProbabilityTable ProbabilityTable;
+        uint32_t Frequencies[256];
+        {
+            stats::ModelTimer timer(Stats);
+            ProbabilityTable.GenerateTable(UncompressedBuffer, SampleSize);
+            ProbabilityTable.Normalize(ScaleBits(Variant));
+            for (uint16_t i = 0; i < 256; i++) {
+                Frequencies[i] = ProbabilityTable.GetFrequency(uint8_t(i));
+            }
+        }
+
+        uint8_t shift = ProbabilityTable.GetShift();
+        uint64_t size = UncompressedBuffer.Size();
+        buffer::CodecBufferWrapper Buffer(UncompressedBuffer, shift);
+        CompressedBuffer.Reserve(ProbabilityTable.EstimateBits() + 128u);
+        CompressedBuffer.WriteByte(shift);
+        CompressedBuffer.WriteByte(Lanes);
+        CompressedBuffer.WriteByte(size == 0 ? 0u : (UncompressedBuffer[size-1u]<<shift) + (UncompressedBuffer[0]>>(8u-shift)));
+
+        // As in the arithmetic coder, the residual byte carries the last byte
+        uint64_t SymbolCount = size == 0 ? 0u : size - 1u;
+        encode(Buffer, SymbolCount, Frequencies, CompressedBuffer);
+
+        std::vector<unsigned char>& Output = CompressedBuffer.GetBuffer();
+        buffer::EncodeTypeToBuffer<uint64_t>(Output, 0, &size);
+        for (uint16_t i = 0; i < 256; i++) {
+            auto frequency = uint16_t(Frequencies[i]);
+            buffer::EncodeTypeToBuffer<uint16_t>(Output, 8u + 2u*i, &frequency);
+        }
+        return Success;
+    }
+
+    inline CodecStatusCode UncompressBuffer(std::vector<unsigned char>& UncompressedBuffer,
+                                            buffer::ByteView CompressedBuffer,
+                                            AnsVariant Variant = RansVariant,
+                                            stats::CoderStats* Stats = nullptr) {
+        if (CompressedBuffer.Size() < PayloadOffset) {
+            throw std::runtime_error("Truncated Compression Stream.");
+        }
+        uint64_t size;
+        uint32_t Frequencies[256];
+        buffer::DecodeTypeFromBuffer<uint64_t>(CompressedBuffer, 0, &size);
+        UncompressedBuffer.clear();
+        if (size == 0) {
+            return Success;
+        }
+        {
+            stats::ModelTimer timer(Stats);
+            DecodeFrequencies(CompressedBuffer, ScaleBits(Variant), size - 1u, Frequencies);
+        }
+
+        uint8_t shift = CompressedBuffer[HeaderLength];
+        LaneDecoder decode = SelectDecoder(Variant, CompressedBuffer[HeaderLength + 1u]);
+        uint8_t residual = CompressedBuffer[HeaderLength + 2u];
+        if (shift > 7u) {
+            throw std::runtime_error("Corrupt Compression Stream.");
+        }
+
+        UncompressedBuffer.resize(size);
+        decode(CompressedBuffer, size - 1u, Frequencies, UncompressedBuffer.data());
+        arith::RestoreShift(UncompressedBuffer, shift, residual);
+        return Success;
+    }
+}
@@ -7,74 +7,208 @@
 #include <bitset>
 #include <cstring>
 #include <algorithm>
-#include <chrono>
+#include <memory>
+#include <tuple>
+#include <stdexcept>
 
 #include "bufferops.h"
+#include "stats.h"
 
 namespace arith {
-    void ComputeProbabilities(uint32_t* ProbabilityTable, std::vector<unsigned char>& UncompressedBuffer, uint8_t BitShift) {
-        memset(ProbabilityTable, 0u, 256*4);
-        uint8_t val;
+    // Inputs shorter than this count every shift directly; longer ones go through the pair histogram, whose fixed cost
+    // of folding 64K pairs is then small next to the input
+    const uint64_t PairHistogramThreshold = 1ull<<17u;
+    // Positions counted into the 32-bit pair histogram before it is folded into the 64-bit totals
+    const uint64_t PairHistogramChunk = 1ull<<31u;
+    const uint32_t PairCount = 1u<<16u;
 
-        for (uint32_t i = 0; i < MIN(UncompressedBuffer.size() - 1, UINT32_MAX); i++) {
-            val = ((uint8_t) UncompressedBuffer[i] << BitShift) +
-                  ((uint8_t) UncompressedBuffer[i + 1] >> (8 - BitShift));
-            ProbabilityTable[val]++;
+    // Pairs[(Buffer[i]<<8) | Buffer[i+1]] is the number of positions i holding that pair of bytes. Two interleaved
+    // copies of the histogram keep runs of one value from stalling on store forwarding, in counts, which is sized on
+    // first use so that a caller can keep it between blocks.
+    inline void ComputePairCounts(uint64_t* Pairs, buffer::ByteView UncompressedBuffer,
+                                  std::vector<uint32_t>& counts) {
+        memset(Pairs, 0u, PairCount*sizeof(uint64_t));
+        uint64_t size = UncompressedBuffer.Size();
+        const unsigned char* data = UncompressedBuffer.Data();
+
+        if (size < 2) {
+            return;
+        }
+
+        counts.resize(2u*PairCount);
+        for (uint64_t start = 0; start < size - 1u; start += PairHistogramChunk) {
+            uint64_t end = MIN(start + PairHistogramChunk, size - 1u);
+            std::fill(counts.begin(), counts.end(), 0u);
+
+            uint32_t* even = counts.data();
+            uint32_t* odd = counts.data() + PairCount;
+            uint32_t pair = data[start];
+            uint64_t i = start;
+            for (; i + 2u <= end; i += 2u) {
+                pair = ((pair << 8u) | data[i + 1])&0xFFFFu;
+                even[pair]++;
+                pair = ((pair << 8u) | data[i + 2])&0xFFFFu;
+                odd[pair]++;
+            }
+            if (i < end) {
+                pair = ((pair << 8u) | data[i + 1])&0xFFFFu;
+                even[pair]++;
+            }
+
+            for (uint32_t p = 0; p < PairCount; p++) {
+                Pairs[p] += uint64_t(even[p]) + odd[p];
+            }
         }
     }
 
-    double ArithmeticMean(const uint32_t* Data, uint64_t Size) {
-        double sum = 0;
+    inline void ComputePairCounts(uint64_t* Pairs, buffer::ByteView UncompressedBuffer) {
+        std::vector<uint32_t> counts;
+        ComputePairCounts(Pairs, UncompressedBuffer, counts);
+    }
 
-        for (uint64_t i = 0; i < Size; i++) {
-            sum += double(*(Data+i));
+    // Sums the shifted histograms laid out as by ComputeProbabilities out of pair counts
+    inline void FoldPairCounts(uint64_t* Tables, const uint64_t* Pairs) {
+        memset(Tables, 0u, 256*8*sizeof(uint64_t));
+        for (uint32_t p = 0; p < PairCount; p++) {
+            if (Pairs[p] == 0) {
+                continue;
+            }
+            for (uint8_t shift = 0; shift < 8; shift++) {
+                Tables[shift*256u + ((p >> (8u - shift))&0xFFu)] += Pairs[p];
+            }
+        }
+    }
+
+    // Counts the input realigned to every bit shift in one pass: Tables[Shift*256 + Byte] is the number of positions
+    // whose byte, read Shift bits further on, is Byte. Every shift of a position is a window of the byte pair starting
+    // there, so long inputs bump one counter of the pair histogram per byte and sum the eight shifted tables out of it.
+    inline void ComputeProbabilities(uint64_t* Tables, buffer::ByteView UncompressedBuffer) {
+        memset(Tables, 0u, 256*8*sizeof(uint64_t));
+        uint64_t size = UncompressedBuffer.Size();
+        const unsigned char* data = UncompressedBuffer.Data();
+
+        if (size < 2) {
+            return;
         }
 
-        return sum / (double) Size;
+        if (size < PairHistogramThreshold) {
+            uint32_t counts[2][256*8] = {{0}};
+            for (uint64_t i = 0; i < size - 1u; i++) {
+                uint32_t pair = (uint32_t(data[i]) << 8u) | data[i + 1];
+                uint32_t* copy = counts[i&1u];
+                #pragma GCC unroll 8
+                for (uint8_t shift = 0; shift < 8; shift++) {
+                    copy[shift*256u + ((pair >> (8u - shift))&0xFFu)]++;
+                }
+            }
+            for (uint16_t i = 0; i < 256*8; i++) {
+                Tables[i] = uint64_t(counts[0][i]) + counts[1][i];
+            }
+            return;
+        }
+
+        std::vector<uint64_t> pairs(PairCount);
+        ComputePairCounts(pairs.data(), UncompressedBuffer);
+        FoldPairCounts(Tables, pairs.data());
+    }
+
+    // Count*log2(Count) for the counts of short inputs, so that their entropies take no logarithms
+    const uint32_t EntropyTableSize = 1u<<12u;
+
+    inline double CountBits(uint64_t Count) {
+        static const std::vector<double> table = [] {
+            std::vector<double> bits(EntropyTableSize, 0.0);
+            for (uint32_t i = 1; i < EntropyTableSize; i++) {
+                bits[i] = double(i)*std::log2(double(i));
+            }
+            return bits;
+        }();
+        return Count < EntropyTableSize ? table[Count] : double(Count)*std::log2(double(Count));
     }
 
-    double StandardDeviation(const uint32_t* Data, uint64_t Size) {
-        double mean = ArithmeticMean(Data, Size);
-        double sum = 0;
+    // Bits an ideal static coder spends on Size symbols with these counts, the Shannon entropy times their total
+    inline double EntropyBits(const uint64_t* Counts, uint64_t Size) {
+        uint64_t total = 0;
+        double bits = 0;
 
         for (uint64_t i = 0; i < Size; i++) {
-            sum += pow((double(*(Data+i)) - mean), 2);
+            if (Counts[i] != 0) {
+                total += Counts[i];
+                bits -= CountBits(Counts[i]);
+            }
         }
 
-        return sqrt(sum / ((double) Size - 1));
+        return MAX(bits + CountBits(total), 0.0);
+    }
+
+    // Total the encoder scales the counts to. Old streams carry raw counts and decode through the binary search.
+    const uint8_t ProbabilityScaleBits = 15u;
+    const uint32_t MaxSlotTableSize = 1u<<16u;
+    // Contiguous run read at each point when the model is estimated from a sample
+    const uint64_t SampleChunkSize = 1ull<<16u;
+
+    // Copies about SampleSize bytes of a larger buffer into Sample, in SampleChunkSize runs spread evenly across it
+    inline void SampleBuffer(buffer::ByteView UncompressedBuffer, uint64_t SampleSize,
+                             std::vector<unsigned char>& Sample) {
+        uint64_t chunks = (SampleSize + SampleChunkSize - 1u)/SampleChunkSize;
+        uint64_t stride = UncompressedBuffer.Size()/chunks;
+        uint64_t length = MIN(MIN(SampleChunkSize, SampleSize), stride);
+        Sample.resize(chunks*length);
+        for (uint64_t i = 0; i < chunks; i++) {
+            memcpy(Sample.data() + i*length, UncompressedBuffer.Data() + i*stride, length);
+        }
     }
 
     class CodecProbabilityTable {
     private:
         uint32_t Frequencies[257] = {0};
         uint8_t BitShift;
+        std::vector<uint8_t> Slots;
     public:
-        void GenerateTable(std::vector<unsigned char>& UncompressedBuffer) {
-            uint32_t tables[256*8] = {0};
-            double deviations[8] = {0};
+        // Picks the shift and counts from the whole buffer, or, when SampleSize is non-zero and smaller than the
+        // buffer, from a sample of about SampleSize bytes taken by SampleBuffer. A sampled table gives every symbol a
+        // count of at least 1, since the rest of the buffer may hold symbols the sample missed.
+        void GenerateTable(buffer::ByteView UncompressedBuffer, uint64_t SampleSize = 0) {
+            uint64_t tables[256*8];
+            bool sampled = SampleSize != 0 && SampleSize < UncompressedBuffer.Size();
 
-            for (uint16_t i = 0; i < 8; i++) {
-                ComputeProbabilities(&tables[i*256], UncompressedBuffer, (uint8_t) i);
-                deviations[i] = StandardDeviation(&tables[i*256], 256);
+            if (sampled) {
+                std::vector<unsigned char> sample;
+                SampleBuffer(UncompressedBuffer, SampleSize, sample);
+                ComputeProbabilities(tables, buffer::ByteView(sample.data(), sample.size()));
+            } else {
+                ComputeProbabilities(tables, UncompressedBuffer);
             }
 
-            uint16_t max = 0u;
-            double pmax = 0;
+            // The shift whose symbols have the lowest entropy codes to the fewest bits
+            uint16_t best = 0u;
+            double fewest = EntropyBits(tables, 256);
 
-            for (uint16_t i = 0; i < 8; i++) {
-                if (deviations[i] > pmax) {
-                    pmax = deviations[i];
-                    max = i;
+            for (uint16_t i = 1; i < 8; i++) {
+                double bits = EntropyBits(&tables[i*256], 256);
+                if (bits < fewest) {
+                    fewest = bits;
+                    best = i;
                 }
             }
 
-            std::copy(tables+256*max, tables+256*(max+1), Frequencies + 1);
+            // Inputs past 4 GiB can overflow the 32-bit cumulative counts, so those are scaled down, keeping every
+            // symbol that occurs
+            uint64_t total = 0;
+            for (uint16_t i = 0; i < 256; i++) {
+                total += tables[256*best + i];
+            }
+            uint8_t reduce = 0;
+            while ((total >> reduce) + 256u > UINT32_MAX) {
+                reduce++;
+            }
 
-            for (uint16_t i = 1; i < 257; i++) {
-                Frequencies[i] += Frequencies[i-1];
+            for (uint16_t i = 0; i < 256; i++) {
+                uint64_t count = tables[256*best + i];
+                Frequencies[i+1] = Frequencies[i] + uint32_t(count == 0 && !sampled ? 0u : MAX(count >> reduce, 1ull));
             }
 
-            BitShift = max;
+            BitShift = best;
         }
 
         void DumpTable() {
@@ -98,13 +232,64 @@ namespace arith {
             }
         }
 
-        std::tuple<uint32_t, uint32_t, uint8_t> DecodeFromCount(uint64_t count) {
+        // Scales the counts to a total of 1<<Scale, keeping every symbol that occurs at least 1, so that coding divides
+        // by a power of two
+        void Normalize(uint8_t Scale) {
+            uint64_t total = Frequencies[256];
+            uint32_t target = 1u<<Scale;
+            uint32_t counts[256];
+            uint32_t sum = 0;
+
+            if (total == 0) {
+                return;
+            }
+
             for (uint16_t i = 0; i < 256; i++) {
-                if (Frequencies[i+1] > count) {
-                    return std::make_tuple(Frequencies[i], Frequencies[i+1], i);
+                uint64_t count = Frequencies[i+1] - Frequencies[i];
+                counts[i] = count == 0 ? 0u : uint32_t(MAX(count*target/total, 1ull));
+                sum += counts[i];
+            }
+
+            // The rounding error goes to the most frequent symbols, where it costs the least
+            while (sum != target) {
+                uint32_t* largest = std::max_element(counts, counts + 256);
+                if (sum < target) {
+                    *largest += target - sum;
+                    sum = target;
+                } else {
+                    uint32_t cut = MIN(sum - target, *largest/2u);
+                    *largest -= cut;
+                    sum -= cut;
                 }
             }
-            throw std::runtime_error("Bad Value Encountered In Decode.");
+
+            for (uint16_t i = 0; i < 256; i++) {
+                Frequencies[i+1] = Frequencies[i] + counts[i];
+            }
+        }
+
+        // Reverse lookup for decoding: a slot-to-symbol table when the total is a small power of two, otherwise a
+        // binary search over the cumulative frequencies
+        void BuildDecodeIndex() {
+            uint32_t total = Frequencies[256];
+            Slots.clear();
+            if (total == 0 || (total&(total - 1u)) != 0 || total > MaxSlotTableSize) {
+                return;
+            }
+            Slots.resize(total);
+            for (uint16_t i = 0; i < 256; i++) {
+                memset(Slots.data() + Frequencies[i], i, Frequencies[i+1] - Frequencies[i]);
+            }
+        }
+
+        uint8_t DecodeSymbol(uint64_t Count) {
+            if (Count >= Frequencies[256]) {
+                throw std::runtime_error("Bad Value Encountered In Decode.");
+            }
+            if (!Slots.empty()) {
+                return Slots[Count];
+            }
+            return uint8_t(std::upper_bound(Frequencies + 1, Frequencies + 257, uint32_t(Count)) - Frequencies - 1);
         }
 
         uint8_t GetShift() {
@@ -115,6 +300,22 @@ namespace arith {
             return Frequencies[256];
         }
 
+        uint32_t GetFrequency(unsigned char Byte) {
+            return Frequencies[uint16_t(Byte) + 1u] - Frequencies[Byte];
+        }
+
+        // Estimated coded size of the counted bytes, used to size the output buffer in advance
+        uint64_t EstimateBits() {
+            double bits = 0;
+            for (uint16_t i = 0; i < 256; i++) {
+                double count = Frequencies[i+1] - Frequencies[i];
+                if (count > 0) {
+                    bits += count * log2(double(Frequencies[256]) / count);
+                }
+            }
+            return uint64_t(bits * 1.01) + 64u;
+        }
+
         std::tuple<uint32_t, uint32_t, uint32_t> GetProbability(unsigned char Byte) {
             return std::make_tuple(Frequencies[Byte], Frequencies[uint16_t(Byte) + 1u], Frequencies[256]);
         }
@@ -125,9 +326,12 @@ namespace arith {
             }
         }
 
-        void DecodeFromBuffer(std::vector<unsigned char>& Buffer, uint64_t StartIndex) {
+        void DecodeFromBuffer(buffer::ByteView Buffer, uint64_t StartIndex) {
             for (int i = 1; i < 257; i++) {
                 buffer::DecodeTypeFromBuffer<uint32_t>(Buffer, StartIndex+4*(i-1), &Frequencies[i]);
+                if (Frequencies[i] < Frequencies[i-1]) {
+                    throw std::runtime_error("Bad Probability Table Encountered In Decode.");
+                }
             }
         }
     };
@@ -137,131 +341,668 @@ namespace arith {
     const uint64_t HALF = QUARTER*2ull;
     const uint64_t THREE_QUARTERS = QUARTER*3ull;
 
+    // Binary decisions are coded with the probability of a 1 out of 1<<BitProbabilityBits
+    const uint8_t BitProbabilityBits = 16u;
 
-    void CompressBuffer(std::vector<unsigned char>& InputBuffer,
-                        CodecProbabilityTable& ProbabilityTable,
-                        buffer::CodecByteStream& OutputBuffer) {
-        uint64_t high = MAXVAL;
-        uint64_t low = 0ull;
-        uint8_t shift = ProbabilityTable.GetShift();
-        buffer::CodecBufferWrapper Buffer(InputBuffer, shift);
-        OutputBuffer.WriteByte(shift);
-        OutputBuffer.WriteByte((InputBuffer[InputBuffer.size()-1]<<shift)+(InputBuffer[0]>>(8u-shift))); // residual due to shift
-        uint64_t pLow, pUp, pDenom, range;
+    // The coders renormalize in two strides rather than a bit at a time. First the leading bits Low and High share
+    // have settled and shift out together. That leaves Low reading 01... and High 10..., and the bits after the first
+    // where Low has a 1 and High a 0 straddle the midpoint: the bit-serial scheme removes each by subtracting QUARTER
+    // and shifting, which is the same as dropping them from below the top bit. A renormalization never shifts more
+    // than 32 bits in all, since it scales a non-empty interval up to at most the full range.
+    inline uint8_t SettledBits(uint64_t Low, uint64_t High) {
+        auto differ = uint32_t(Low ^ High);
+        return differ == 0u ? 32u : uint8_t(__builtin_clz(differ));
+    }
+
+    // Low's lowest bit shifts in as a 0, so the word is never zero
+    inline uint8_t StraddlingBits(uint64_t Low, uint64_t High) {
+        return uint8_t(__builtin_clz(uint32_t(~(Low<<1u) | (High<<1u))));
+    }
+
+    // Encoding side of the range coder: narrows [Low, High] to a symbol's share of the range and shifts out the bits
+    // that have settled, deferring undecided ones as pending bits
+    class RangeEncoder {
+    private:
+        uint64_t Low = 0ull;
+        uint64_t High = MAXVAL;
+        buffer::CodecByteStream& Output;
+        stats::CoderStats Stats;
+        bool Straddling = false;
+
+        void Renormalize() {
+            uint8_t settled = SettledBits(Low, High);
+            if (settled != 0u) {
+                uint64_t prefix = Low>>(32u - settled);
+                Output.WriteBitBuffered(uint8_t(prefix>>(settled - 1u)));
+                if (settled > 1u) {
+                    Output.WriteBits(prefix&((1ull<<(settled - 1u)) - 1ull), uint8_t(settled - 1u));
+                }
+                Low = (Low<<settled)&MAXVAL;
+                High = ((High<<settled)|((1ull<<settled) - 1ull))&MAXVAL;
+                Stats.PendingBitRuns += Straddling;
+                Straddling = false;
+            }
+
+            uint8_t straddling = StraddlingBits(Low, High);
+            if (straddling != 0u) {
+                Output.IncPendingBits(straddling);
+                Low = (Low<<straddling)&(HALF - 1ull);
+                High = HALF|((High<<straddling)&(HALF - 1ull))|((1ull<<straddling) - 1ull);
+                Straddling = true;
+            }
+            Stats.Renormalizations += settled + straddling;
+        }
+    public:
+        explicit RangeEncoder(buffer::CodecByteStream& OutputBuffer) : Output(OutputBuffer) {}
+
+        void Encode(uint64_t pLow, uint64_t pUp, uint64_t Denom) {
+            uint64_t range = High - Low + 1ull;
+            High = Low + (range * pUp / Denom) - 1ull;
+            Low = Low + (range * pLow / Denom);
+            Renormalize();
+        }
 
-        // Rate Stuff
-        auto StartTime = std::chrono::high_resolution_clock::now();
-        uint64_t BufSizePct = Buffer.Size()/100ull;
+        // Encode for a total of 1<<DenomShift
+        void EncodeShifted(uint64_t pLow, uint64_t pUp, uint8_t DenomShift) {
+            uint64_t range = High - Low + 1ull;
+            High = Low + ((range * pUp)>>DenomShift) - 1ull;
+            Low = Low + ((range * pLow)>>DenomShift);
+            Renormalize();
+        }
+
+        // P1 is the probability of a 1, between 1 and (1<<BitProbabilityBits) - 1
+        void EncodeBit(uint8_t Bit, uint32_t P1) {
+            uint64_t split = ((High - Low + 1ull) * P1)>>BitProbabilityBits;
+            if (Bit != 0) {
+                High = Low + split - 1ull;
+            } else {
+                Low = Low + split;
+            }
+            Renormalize();
+        }
+
+        // Emits enough bits to identify a value inside the final interval
+        void Finish() {
+            Output.IncPendingBits();
+            Output.WriteBitBuffered(Low < QUARTER ? 0u : 1u);
+            Stats.PendingBitRuns += Straddling;
+            Straddling = false;
+        }
+
+        const stats::CoderStats& Counters() const {
+            return Stats;
+        }
+    };
 
+    // Decoding side of the range coder. GetCount locates the next symbol in a model's cumulative counts; Decode then
+    // narrows the interval exactly as the encoder did.
+    class RangeDecoder {
+    private:
+        uint64_t Low = 0ull;
+        uint64_t High = MAXVAL;
+        uint64_t Value = 0ull;
+        buffer::CodecBitReader Input;
+        stats::CoderStats Stats;
+        bool Straddling = false;
 
-        for (uint64_t i = 0; i < Buffer.Size(); i++) {
+        // Value lies in [Low, High], so it shares their settled and straddling bits and drops them with them
+        void Renormalize() {
+            if (Input.Available() < 32u) {
+                Input.Refill();
+            }
 
-            if ((i<<44ll>>44ull) == 0ull) {
-                std::cout << "\33[2K\r";
-                std::cout << "Compressing... " << i/BufSizePct+1 << "%  @" << double(i)/std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - StartTime).count() << " Bytes/Second." << std::flush;
+            uint8_t settled = SettledBits(Low, High);
+            if (settled != 0u) {
+                Low = (Low<<settled)&MAXVAL;
+                High = ((High<<settled)|((1ull<<settled) - 1ull))&MAXVAL;
+                Value = ((Value<<settled)|Input.Peek(settled))&MAXVAL;
+                Input.Consume(settled);
+                Stats.PendingBitRuns += Straddling;
+                Straddling = false;
             }
 
-            range = high - low + 1ull;
-            std::tie(pLow, pUp, pDenom) = ProbabilityTable.GetProbability(Buffer[i]);
-            high = low + (range * pUp / pDenom) - 1ull;
-            low = low + (range * pLow / pDenom);
+            uint8_t straddling = StraddlingBits(Low, High);
+            if (straddling != 0u) {
+                Low = (Low<<straddling)&(HALF - 1ull);
+                High = HALF|((High<<straddling)&(HALF - 1ull))|((1ull<<straddling) - 1ull);
+                Value = (Value&HALF)|((Value<<straddling)&(HALF - 1ull))|Input.Peek(straddling);
+                Input.Consume(straddling);
+                Straddling = true;
+            }
+            Stats.Renormalizations += settled + straddling;
+        }
+    public:
+        RangeDecoder(buffer::ByteView InputBuffer, uint64_t StartIndex) : Input(InputBuffer, StartIndex) {
+            Input.Refill();
+            Value = Input.Peek(32u);
+            Input.Consume(32u);
+        }
+
+        uint64_t GetCount(uint64_t Denom) {
+            uint64_t range = High - Low + 1ull;
+            return ((Value - Low + 1ull) * Denom - 1ull) / range;
+        }
+
+        void Decode(uint64_t pLow, uint64_t pUp, uint64_t Denom) {
+            uint64_t range = High - Low + 1ull;
+            High = Low + (range * pUp) / Denom - 1ull;
+            Low = Low + (range * pLow) / Denom;
+            Renormalize();
+        }
 
+        void DecodeShifted(uint64_t pLow, uint64_t pUp, uint8_t DenomShift) {
+            uint64_t range = High - Low + 1ull;
+            High = Low + ((range * pUp)>>DenomShift) - 1ull;
+            Low = Low + ((range * pLow)>>DenomShift);
+            Renormalize();
+        }
+
+        uint8_t DecodeBit(uint32_t P1) {
+            uint64_t split = ((High - Low + 1ull) * P1)>>BitProbabilityBits;
+            uint8_t bit = Value < Low + split ? 1u : 0u;
+            if (bit != 0) {
+                High = Low + split - 1ull;
+            } else {
+                Low = Low + split;
+            }
+            Renormalize();
+            return bit;
+        }
+
+        const stats::CoderStats& Counters() const {
+            return Stats;
+        }
+    };
+
+    // Byte-wise carryless range coder after Subbotin. Low and Range are 32 bits wide and a byte shifts out whenever
+    // the top byte of Low has settled. When Range falls below CarrylessBottom first, it is cut back to end at the next
+    // multiple of CarrylessBottom above Low, which settles the top byte at the cost of a sliver of the interval; no
+    // carry can reach bytes already written, so there are no pending bits. Totals are powers of two up to 1<<16.
+    const uint32_t CarrylessTop = 1u<<24u;
+    const uint32_t CarrylessBottom = 1u<<16u;
+    const uint8_t CarrylessMaxShift = 16u;
+
+    class CarrylessEncoder {
+    private:
+        uint32_t Low = 0u;
+        uint32_t Range = UINT32_MAX;
+        buffer::CodecByteStream& Output;
+        stats::CoderStats Stats;
+
+        void Renormalize() {
             while (true) {
-                if (high < HALF) {
-                    OutputBuffer.WriteBitBuffered(0u);
-                } else if (low >= HALF) {
-                    OutputBuffer.WriteBitBuffered(1u);
-                } else if (high < THREE_QUARTERS && low >= QUARTER) {
-                    OutputBuffer.IncPendingBits();
-                    low -= QUARTER;
-                    high -= QUARTER;
-                } else {
-                    break;
+                if ((Low ^ (Low + Range)) >= CarrylessTop) {
+                    if (Range >= CarrylessBottom) {
+                        break;
+                    }
+                    Range = (0u - Low)&(CarrylessBottom - 1u);
+                }
+                Output.WriteByte(uint8_t(Low>>24u));
+                Low <<= 8u;
+                Range <<= 8u;
+                Stats.Renormalizations += 8u;
+            }
+        }
+    public:
+        explicit CarrylessEncoder(buffer::CodecByteStream& Stream) : Output(Stream) {}
+
+        // Codes the symbol owning [Low, Up) of a total of 1<<TotalShift
+        void Encode(uint32_t SymbolLow, uint32_t SymbolUp, uint8_t TotalShift) {
+            Range >>= TotalShift;
+            Low += SymbolLow*Range;
+            Range *= SymbolUp - SymbolLow;
+            Renormalize();
+        }
+
+        void Finish() {
+            for (int i = 0; i < 4; i++) {
+                Output.WriteByte(uint8_t(Low>>24u));
+                Low <<= 8u;
+            }
+        }
+
+        const stats::CoderStats& Counters() const {
+            return Stats;
+        }
+    };
+
+    // Decoding side of the carryless coder. Bytes past the end of the stream read as zero.
+    class CarrylessDecoder {
+    private:
+        uint32_t Low = 0u;
+        uint32_t Range = UINT32_MAX;
+        uint32_t Code = 0u;
+        const unsigned char* Data;
+        uint64_t Size;
+        uint64_t Index;
+        stats::CoderStats Stats;
+
+        uint8_t NextByte() {
+            return Index < Size ? Data[Index++] : 0u;
+        }
+
+        void Renormalize() {
+            while (true) {
+                if ((Low ^ (Low + Range)) >= CarrylessTop) {
+                    if (Range >= CarrylessBottom) {
+                        break;
+                    }
+                    Range = (0u - Low)&(CarrylessBottom - 1u);
+                }
+                Code = (Code<<8u)|NextByte();
+                Low <<= 8u;
+                Range <<= 8u;
+                Stats.Renormalizations += 8u;
+            }
+        }
+    public:
+        CarrylessDecoder(buffer::ByteView Input, uint64_t Start) {
+            Data = Input.Data();
+            Size = Input.Size();
+            Index = Start;
+            for (int i = 0; i < 4; i++) {
+                Code = (Code<<8u)|NextByte();
+            }
+        }
+
+        // Count within a total of 1<<TotalShift that the next symbol covers; must be followed by Decode. A corrupt
+        // stream can yield counts past the total, which the model's DecodeSymbol rejects.
+        uint32_t GetCount(uint8_t TotalShift) {
+            Range >>= TotalShift;
+            return (Code - Low)/Range;
+        }
+
+        void Decode(uint32_t SymbolLow, uint32_t SymbolUp) {
+            Low += SymbolLow*Range;
+            Range *= SymbolUp - SymbolLow;
+            Renormalize();
+        }
+
+        const stats::CoderStats& Counters() const {
+            return Stats;
+        }
+    };
+
+    // Models for adaptive coding. A model codes one byte at a time through the range coder and then updates itself,
+    // identically on both sides, so new models plug into CompressModeled/UncompressModeled without changes there:
+    //
+    //  void Encode(RangeEncoder& Encoder, uint8_t Symbol);
+    //  uint8_t Decode(RangeDecoder& Decoder);
+    //  void Reset();  // back to the freshly constructed state, reusing the model's memory
+    //
+    // Order-0 model that encoder and decoder update in lockstep, so no frequency table is stored. Counts
+    // start at 1 so every byte stays codable; each coded byte adds AdaptiveIncrement to its count, and all counts are
+    // halved once the total passes AdaptiveLimit, which also lets the model follow drifting statistics. A Fenwick
+    // tree keeps cumulative queries, symbol searches and updates at O(log 256).
+    const uint32_t AdaptiveIncrement = 32u;
+    const uint32_t AdaptiveLimit = 1u<<16u;
+
+    class AdaptiveModel {
+    private:
+        uint32_t Counts[256];
+        uint32_t Tree[257];
+        uint32_t Total;
+
+        void Rebuild() {
+            Total = 0;
+            memset(Tree, 0, sizeof(Tree));
+            for (uint16_t i = 1; i <= 256; i++) {
+                Tree[i] += Counts[i-1];
+                Total += Counts[i-1];
+                uint16_t parent = i + (i&-i);
+                if (parent <= 256) {
+                    Tree[parent] += Tree[i];
+                }
+            }
+        }
+    public:
+        AdaptiveModel() {
+            Reset();
+        }
+
+        void Reset() {
+            std::fill(Counts, Counts + 256, 1u);
+            Rebuild();
+        }
+
+        uint32_t GetDenom() {
+            return Total;
+        }
+
+        // Cumulative count of the symbols below Symbol, and its own count
+        void GetRange(uint8_t Symbol, uint32_t& Low, uint32_t& Up) {
+            Low = 0;
+            for (uint16_t i = Symbol; i > 0; i -= i&-i) {
+                Low += Tree[i];
+            }
+            Up = Low + Counts[Symbol];
+        }
+
+        // Symbol whose cumulative range holds Count, found by descending the tree
+        uint8_t FindSymbol(uint32_t Count, uint32_t& Low, uint32_t& Up) {
+            if (Count >= Total) {
+                throw std::runtime_error("Bad Value Encountered In Decode.");
+            }
+            uint16_t position = 0;
+            uint32_t remaining = Count;
+            for (uint16_t step = 128; step > 0; step >>= 1u) {
+                if (Tree[position + step] <= remaining) {
+                    position += step;
+                    remaining -= Tree[position];
+                }
+            }
+            Low = Count - remaining;
+            Up = Low + Counts[position];
+            return uint8_t(position);
+        }
+
+        void Encode(RangeEncoder& Encoder, uint8_t Symbol) {
+            uint32_t low, up;
+            GetRange(Symbol, low, up);
+            Encoder.Encode(low, up, Total);
+            Update(Symbol);
+        }
+
+        uint8_t Decode(RangeDecoder& Decoder) {
+            uint32_t low, up;
+            uint8_t symbol = FindSymbol(uint32_t(Decoder.GetCount(Total)), low, up);
+            Decoder.Decode(low, up, Total);
+            Update(symbol);
+            return symbol;
+        }
+
+        void Update(uint8_t Symbol) {
+            Counts[Symbol] += AdaptiveIncrement;
+            Total += AdaptiveIncrement;
+            if (Total > AdaptiveLimit) {
+                for (uint16_t i = 0; i < 256; i++) {
+                    Counts[i] = (Counts[i] + 1u)>>1u;
                 }
-                high <<= 1ull;
-                high++;
-                low <<= 1ull;
-                high &= MAXVAL;
-                low &= MAXVAL;
+                Rebuild();
+                return;
+            }
+            for (uint16_t i = uint16_t(Symbol) + 1u; i <= 256; i += i&-i) {
+                Tree[i] += AdaptiveIncrement;
             }
         }
+    };
 
-        OutputBuffer.IncPendingBits();
-        if (low < QUARTER) {
-            OutputBuffer.WriteBitBuffered(0);
+    // Moves a bit probability a 1/(1<<BitAdaptRate) step towards the bit just coded; it stays within (0, 1<<16)
+    const uint8_t BitAdaptRate = 4u;
+
+    inline void UpdateBit(uint16_t& P1, uint8_t Bit) {
+        if (Bit != 0) {
+            P1 += (65536u - P1)>>BitAdaptRate;
         } else {
-            OutputBuffer.WriteBitBuffered(1);
+            P1 -= P1>>BitAdaptRate;
+        }
+    }
+
+    // Order-N context model coding a byte as eight binary decisions down a 255-node tree. Each context owns a
+    // 512-byte block of node probabilities, aligned to cache lines. Contexts wider than SlotBits are hashed into
+    // 1<<SlotBits blocks, which keeps the table at a fixed size chosen to stay in L2.
+    template<uint8_t Order, uint8_t SlotBits>
+    class ContextModel {
+    private:
+        std::vector<unsigned char> Storage;
+        uint16_t* Table;
+        uint16_t* Current;
+        uint32_t History = 0;
+
+        void SelectContext() {
+            uint32_t context = uint32_t(History&((1ull<<(8u*Order)) - 1ull));
+            uint32_t slot = 8u*Order <= SlotBits ? context : (context*2654435761u)>>(32u - SlotBits);
+            Current = Table + (uint64_t(slot)<<8u);
+        }
+    public:
+        ContextModel() {
+            uint64_t entries = 1ull<<(SlotBits + 8u);
+            Storage.resize(entries*sizeof(uint16_t) + 64u);
+            void* aligned = Storage.data();
+            size_t space = Storage.size();
+            Table = static_cast<uint16_t*>(std::align(64u, entries*sizeof(uint16_t), aligned, space));
+            Reset();
+        }
+
+        void Reset() {
+            std::fill(Table, Table + (1ull<<(SlotBits + 8u)), uint16_t(1u<<15u));
+            History = 0;
+            SelectContext();
+        }
+
+        ContextModel(const ContextModel&) = delete;
+        ContextModel& operator=(const ContextModel&) = delete;
+
+        // Probability of a 1 at a node of the current context's tree
+        uint16_t& Probability(uint16_t Node) {
+            return Current[Node];
+        }
+
+        void Advance(uint8_t Symbol) {
+            History = (History<<8u)|Symbol;
+            SelectContext();
+        }
+
+        void Encode(RangeEncoder& Encoder, uint8_t Symbol) {
+            uint16_t node = 1;
+            for (int i = 7; i >= 0; i--) {
+                uint8_t bit = (Symbol>>i)&1u;
+                Encoder.EncodeBit(bit, Current[node]);
+                UpdateBit(Current[node], bit);
+                node = uint16_t((node<<1u)|bit);
+            }
+            Advance(Symbol);
+        }
+
+        uint8_t Decode(RangeDecoder& Decoder) {
+            uint16_t node = 1;
+            while (node < 256u) {
+                uint8_t bit = Decoder.DecodeBit(Current[node]);
+                UpdateBit(Current[node], bit);
+                node = uint16_t((node<<1u)|bit);
+            }
+            auto symbol = uint8_t(node);
+            Advance(symbol);
+            return symbol;
+        }
+    };
+
+    typedef ContextModel<1, 8> Order1Model;
+    typedef ContextModel<2, 11> Order2Model;
+
+    // Logistic-domain helpers on 12-bit probabilities: Squash maps a stretched value in (-2048, 2048) back to a
+    // probability by interpolating the logistic function, Stretch inverts it through a table.
+    inline int32_t Squash(int32_t Value) {
+        static const int32_t curve[33] = {1, 2, 3, 6, 10, 16, 27, 45, 73, 120, 194, 310, 488, 747, 1101, 1546, 2047,
+                                          2549, 2994, 3348, 3607, 3785, 3901, 3975, 4022, 4050, 4068, 4079, 4085,
+                                          4089, 4092, 4093, 4094};
+        if (Value > 2047) {
+            return 4095;
+        }
+        if (Value < -2047) {
+            return 1;
         }
+        int32_t weight = Value&127;
+        int32_t index = (Value>>7) + 16;
+        return (curve[index]*(128 - weight) + curve[index + 1]*weight + 64)>>7;
+    }
 
-        std::cout << std::endl;
+    inline int32_t Stretch(uint16_t Probability) {
+        static const std::vector<int16_t> table = [] {
+            std::vector<int16_t> inverse(4096);
+            int32_t next = 0;
+            for (int32_t x = -2047; x <= 2047; x++) {
+                int32_t value = Squash(x);
+                for (int32_t i = next; i <= value; i++) {
+                    inverse[i] = int16_t(x);
+                }
+                next = value + 1;
+            }
+            for (int32_t i = next; i < 4096; i++) {
+                inverse[i] = 2047;
+            }
+            return inverse;
+        }();
+        return table[Probability>>4u];
     }
 
-    void UncompressBuffer(std::vector<unsigned char>& InputBuffer,
-                          CodecProbabilityTable& ProbabilityTable,
-                          buffer::CodecByteStream& OutputBuffer,
-                          uint64_t UncompressedSize) {
-        uint8_t shift = InputBuffer[256*4+8];
-        uint8_t residual_byte = InputBuffer[256*4+9];
-        buffer::CodecBitIterator Buffer(InputBuffer, 256*4+10);
-        uint64_t high = MAXVAL;
-        uint64_t low = 0ull;
-        uint64_t value = 0ull;
-        uint64_t range, denom, count, pLow, pUp;
-        denom = ProbabilityTable.GetDenom();
-        uint8_t byte;
+    // Binary context mixing of order-0, order-1 and order-2 predictions. Their stretched probabilities are weighted
+    // by one of 256 small mixers, selected by the tree node, which are trained online to reduce coding cost.
+    class MixingModel {
+    private:
+        static const uint8_t Inputs = 3u;
+        static const int32_t LearningRate = 7;
 
-        // Rate Stuff
-        auto StartTime = std::chrono::high_resolution_clock::now();
-        uint64_t StartSize = UncompressedSize;
-        uint64_t BufSizePct = UncompressedSize/100ull;
+        ContextModel<0, 0> Order0;
+        Order1Model Order1;
+        Order2Model Order2;
+        int32_t Weights[256][Inputs];
+        int32_t Stretched[Inputs];
+        int32_t Mixed = 2048;
 
-        if (shift != 0) {
-            for (uint8_t i = 0; i < shift; i++) {
-                OutputBuffer.WriteBit((residual_byte>>(shift-i-1u))&1u);
+        uint32_t Predict(uint16_t Node) {
+            Stretched[0] = Stretch(Order0.Probability(Node));
+            Stretched[1] = Stretch(Order1.Probability(Node));
+            Stretched[2] = Stretch(Order2.Probability(Node));
+            int64_t dot = 0;
+            for (uint8_t i = 0; i < Inputs; i++) {
+                dot += int64_t(Weights[Node][i])*Stretched[i];
             }
+            Mixed = Squash(int32_t(dot>>16));
+            return uint32_t(Mixed)<<4u;
         }
 
-        for (uint8_t i = 0; i < 32; i++) {
-            value <<= 1ull;
-            value += Buffer.ReadBit();
+        void Learn(uint16_t Node, uint8_t Bit) {
+            int32_t error = ((int32_t(Bit)<<12) - Mixed)*LearningRate;
+            for (uint8_t i = 0; i < Inputs; i++) {
+                Weights[Node][i] += (Stretched[i]*error + 0x8000)>>16;
+            }
+            UpdateBit(Order0.Probability(Node), Bit);
+            UpdateBit(Order1.Probability(Node), Bit);
+            UpdateBit(Order2.Probability(Node), Bit);
         }
 
-        while (UncompressedSize > 1) {
+        void Advance(uint8_t Symbol) {
+            Order0.Advance(Symbol);
+            Order1.Advance(Symbol);
+            Order2.Advance(Symbol);
+        }
 
-            if ((UncompressedSize<<44ll>>44ull) == 0ull) {
-                std::cout << "\33[2K\r";
-                std::cout << "Uncompressing... " << 101ull-UncompressedSize/BufSizePct << "%  @" << (StartSize-UncompressedSize)/std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - StartTime).count() << " Bytes/Second." << std::flush;
+        void ResetWeights() {
+            for (auto& weights : Weights) {
+                std::fill(weights, weights + Inputs, (1 << 16)/Inputs);
             }
+            Mixed = 2048;
+        }
+    public:
+        MixingModel() {
+            ResetWeights();
+        }
 
-            range = high-low+1ull;
-            count = ((value - low + 1ull) * denom - 1ull) / range;
-            std::tie(pLow, pUp, byte) = ProbabilityTable.DecodeFromCount(count);
-            OutputBuffer.WriteByte(byte);
-            high = low + (range*pUp)/denom - 1ull;
-            low = low + (range*pLow)/denom;
+        void Reset() {
+            Order0.Reset();
+            Order1.Reset();
+            Order2.Reset();
+            ResetWeights();
+        }
 
-            while (true) {
-                if (high < HALF) {
-                    //pass;
-                } else if (low >= HALF) {
-                    value -= HALF;
-                    low -= HALF;
-                    high -= HALF;
-                } else if (high < THREE_QUARTERS && low >= QUARTER) {
-                    value -= QUARTER;
-                    low -= QUARTER;
-                    high -= QUARTER;
-                } else {
-                    break;
-                }
-                low <<= 1ull;
-                high <<= 1ull;
-                high++;
-                value <<= 1ull;
-                value += Buffer.ReadBit();
+        void Encode(RangeEncoder& Encoder, uint8_t Symbol) {
+            uint16_t node = 1;
+            for (int i = 7; i >= 0; i--) {
+                uint8_t bit = (Symbol>>i)&1u;
+                Encoder.EncodeBit(bit, Predict(node));
+                Learn(node, bit);
+                node = uint16_t((node<<1u)|bit);
             }
+            Advance(Symbol);
+        }
+
+        uint8_t Decode(RangeDecoder& Decoder) {
+            uint16_t node = 1;
+            while (node < 256u) {
+                uint8_t bit = Decoder.DecodeBit(Predict(node));
+                Learn(node, bit);
+                node = uint16_t((node<<1u)|bit);
+            }
+            auto symbol = uint8_t(node);
+            Advance(symbol);
+            return symbol;
+        }
+    };
+
+    // Stats, when given, is added the coder's counters for the buffer
+    inline void CompressBuffer(buffer::ByteView InputBuffer,
+                               CodecProbabilityTable& ProbabilityTable,
+                               buffer::CodecByteStream& OutputBuffer,
+                               stats::CoderStats* Stats) {
+        RangeEncoder Encoder(OutputBuffer);
+        uint8_t shift = ProbabilityTable.GetShift();
+        buffer::CodecBufferWrapper Buffer(InputBuffer, shift);
+        OutputBuffer.Reserve(ProbabilityTable.EstimateBits() + 16u);
+        OutputBuffer.WriteByte(shift);
+        if (InputBuffer.Size() == 0) {
+            OutputBuffer.WriteByte(0u);
+            return;
+        }
+        OutputBuffer.WriteByte((InputBuffer[InputBuffer.Size()-1]<<shift)+(InputBuffer[0]>>(8u-shift))); // residual due to shift
+        uint64_t pLow, pUp;
+        // The residual byte carries the last byte, so one symbol fewer than the input length is coded for any shift
+        uint64_t SymbolCount = InputBuffer.Size() - 1u;
+        // Normalized totals are powers of two, so the interval updates divide with a shift
+        const uint8_t DenomShift = SymbolCount == 0 ? 0u : uint8_t(__builtin_ctz(ProbabilityTable.GetDenom()));
+
+        for (uint64_t i = 0; i < SymbolCount; i++) {
+            std::tie(pLow, pUp, std::ignore) = ProbabilityTable.GetProbability(Buffer[i]);
+            Encoder.EncodeShifted(pLow, pUp, DenomShift);
+        }
+
+        Encoder.Finish();
+
+        if (Stats != nullptr) {
+            Stats->Add(Encoder.Counters());
+        }
+    }
+
+    inline void UncompressBuffer(buffer::ByteView InputBuffer,
+                                 CodecProbabilityTable& ProbabilityTable,
+                                 buffer::CodecByteStream& OutputBuffer,
+                                 uint64_t UncompressedSize,
+                                 stats::CoderStats* Stats) {
+        if (UncompressedSize == 0) {
+            return;
+        }
+        OutputBuffer.Reserve(8u*UncompressedSize);
+        uint8_t shift = InputBuffer[256*4+8];
+        uint8_t residual_byte = InputBuffer[256*4+9];
+        if (shift > 7u) {
+            throw std::runtime_error("Bad Bit Shift Encountered In Decode.");
+        }
+        uint64_t denom, pLow, pUp;
+        denom = ProbabilityTable.GetDenom();
+        {
+            stats::ModelTimer timer(Stats);
+            ProbabilityTable.BuildDecodeIndex();
+        }
+        const bool PowerOfTwo = denom != 0 && (denom&(denom - 1u)) == 0;
+        const uint8_t DenomShift = PowerOfTwo ? uint8_t(__builtin_ctzll(denom)) : 0u;
+        uint8_t byte;
 
+        if (shift != 0) {
+            for (uint8_t i = 0; i < shift; i++) {
+                OutputBuffer.WriteBit((residual_byte>>(shift-i-1u))&1u);
+            }
+        }
 
+        RangeDecoder Decoder(InputBuffer, 256*4+10);
+        while (UncompressedSize > 1) {
+            byte = ProbabilityTable.DecodeSymbol(Decoder.GetCount(denom));
+            std::tie(pLow, pUp, std::ignore) = ProbabilityTable.GetProbability(byte);
+            OutputBuffer.WriteByte(byte);
+            if (PowerOfTwo) {
+                Decoder.DecodeShifted(pLow, pUp, DenomShift);
+            } else {
+                Decoder.Decode(pLow, pUp, denom);
+            }
             UncompressedSize--;
         }
 
@@ -269,46 +1010,225 @@ namespace arith {
             OutputBuffer.WriteBit((residual_byte>>(7u-i))&1u);
         }
 
-        std::cout << std::endl;
+        if (Stats != nullptr) {
+            Stats->Add(Decoder.Counters());
+        }
     }
 
-    // Buffer Compression/Decompression API
-    CodecStatusCode CompressBuffer(std::vector<unsigned char>& UncompressedBuffer, buffer::CodecByteStream& CompressedBuffer) {
-        std::cout << "Initializing Compressor..." << std::endl;
+    // Buffer Compression/Decompression API. Nothing is printed; Stats, when given, is added the time spent on the model
+    // and the range coder's counters. SampleSize as for CodecProbabilityTable::GenerateTable, 0 to read the whole buffer
+    inline CodecStatusCode CompressBuffer(buffer::ByteView UncompressedBuffer,
+                                          buffer::CodecByteStream& CompressedBuffer,
+                                          uint64_t SampleSize = 0,
+                                          stats::CoderStats* Stats = nullptr) {
         CodecProbabilityTable ProbabilityTable;
-        ProbabilityTable.GenerateTable(UncompressedBuffer);
-        CompressBuffer(UncompressedBuffer, ProbabilityTable, CompressedBuffer);
-        uint64_t UncompressedBufferSize = UncompressedBuffer.size();
+        {
+            stats::ModelTimer timer(Stats);
+            ProbabilityTable.GenerateTable(UncompressedBuffer, SampleSize);
+            ProbabilityTable.Normalize(ProbabilityScaleBits);
+        }
+        CompressBuffer(UncompressedBuffer, ProbabilityTable, CompressedBuffer, Stats);
+        uint64_t UncompressedBufferSize = UncompressedBuffer.Size();
         buffer::EncodeTypeToBuffer<uint64_t>(CompressedBuffer.GetBuffer(), 0, &UncompressedBufferSize);
         ProbabilityTable.EncodeToBuffer(CompressedBuffer.GetBuffer(), 8);
         return Success;
     }
 
-    CodecStatusCode UncompressBuffer(buffer::CodecByteStream& UncompressedBuffer, std::vector<unsigned char>& CompressedBuffer) {
-        std::cout << "Initializing Uncompressor..." << std::endl;
+    inline CodecStatusCode UncompressBuffer(buffer::CodecByteStream& UncompressedBuffer,
+                                            buffer::ByteView CompressedBuffer,
+                                            stats::CoderStats* Stats = nullptr) {
         uint64_t UncompressedBufferSize;
         CodecProbabilityTable ProbabilityTable;
 
+        if (CompressedBuffer.Size() < 256*4+10) {
+            throw std::runtime_error("Truncated Compression Stream.");
+        }
         buffer::DecodeTypeFromBuffer<uint64_t>(CompressedBuffer, 0, &UncompressedBufferSize);
-        ProbabilityTable.DecodeFromBuffer(CompressedBuffer, 8);
+        {
+            stats::ModelTimer timer(Stats);
+            ProbabilityTable.DecodeFromBuffer(CompressedBuffer, 8);
+        }
 
         UncompressBuffer(CompressedBuffer,
                          ProbabilityTable,
                          UncompressedBuffer,
-                         UncompressedBufferSize);
+                         UncompressedBufferSize,
+                         Stats);
+
+        return Success;
+    }
+
+    // Symbols are decoded into Output[0, Size-1). Realigning them by the shift restores the input in place: byte j
+    // takes the low bits of symbol j-1 and the high bits of symbol j, with the residual byte standing in at both ends.
+    inline void RestoreShift(std::vector<unsigned char>& Output, uint8_t Shift, uint8_t Residual) {
+        uint64_t size = Output.size();
+        Output[size-1u] = Residual;
+        if (Shift == 0) {
+            return;
+        }
+        uint8_t previous = Residual;
+        for (uint64_t i = 0; i < size; i++) {
+            uint8_t current = Output[i];
+            Output[i] = uint8_t((previous<<(8u-Shift))|(current>>Shift));
+            previous = current;
+        }
+    }
+
+    // Carryless Buffer Compression/Decompression API. The stream is laid out as CompressBuffer's, with whole bytes of
+    // the carryless coder after the shift and residual bytes; CompressedBuffer is created with a base length of
+    // 256*4+8. It trades a fraction of a percent of ratio for renormalizing a byte at a time.
+    inline CodecStatusCode CompressCarryless(buffer::ByteView UncompressedBuffer,
+                                             buffer::CodecByteStream& CompressedBuffer,
+                                             uint64_t SampleSize = 0,
+                                             stats::CoderStats* Stats = nullptr) {
+        CodecProbabilityTable ProbabilityTable;
+        {
+            stats::ModelTimer timer(Stats);
+            ProbabilityTable.GenerateTable(UncompressedBuffer, SampleSize);
+            ProbabilityTable.Normalize(ProbabilityScaleBits);
+        }
+        uint8_t shift = ProbabilityTable.GetShift();
+        buffer::CodecBufferWrapper Buffer(UncompressedBuffer, shift);
+        CompressedBuffer.Reserve(ProbabilityTable.EstimateBits() + 64u);
+        CompressedBuffer.WriteByte(shift);
+        if (UncompressedBuffer.Size() == 0) {
+            CompressedBuffer.WriteByte(0u);
+        } else {
+            uint64_t last = UncompressedBuffer.Size() - 1u;
+            CompressedBuffer.WriteByte((UncompressedBuffer[last]<<shift)+(UncompressedBuffer[0]>>(8u-shift)));
+            CarrylessEncoder Encoder(CompressedBuffer);
+            const uint8_t DenomShift = last == 0 ? 0u : uint8_t(__builtin_ctz(ProbabilityTable.GetDenom()));
+            uint32_t pLow, pUp;
+            for (uint64_t i = 0; i < last; i++) {
+                std::tie(pLow, pUp, std::ignore) = ProbabilityTable.GetProbability(Buffer[i]);
+                Encoder.Encode(pLow, pUp, DenomShift);
+            }
+            Encoder.Finish();
+            if (Stats != nullptr) {
+                Stats->Add(Encoder.Counters());
+            }
+        }
+
+        uint64_t UncompressedBufferSize = UncompressedBuffer.Size();
+        buffer::EncodeTypeToBuffer<uint64_t>(CompressedBuffer.GetBuffer(), 0, &UncompressedBufferSize);
+        ProbabilityTable.EncodeToBuffer(CompressedBuffer.GetBuffer(), 8);
+        return Success;
+    }
+
+    inline CodecStatusCode UncompressCarryless(std::vector<unsigned char>& UncompressedBuffer,
+                                               buffer::ByteView CompressedBuffer,
+                                               stats::CoderStats* Stats = nullptr) {
+        uint64_t UncompressedBufferSize;
+        CodecProbabilityTable ProbabilityTable;
+
+        if (CompressedBuffer.Size() < 256*4+10) {
+            throw std::runtime_error("Truncated Compression Stream.");
+        }
+        buffer::DecodeTypeFromBuffer<uint64_t>(CompressedBuffer, 0, &UncompressedBufferSize);
+        uint8_t shift = CompressedBuffer[256*4+8];
+        uint8_t residual_byte = CompressedBuffer[256*4+9];
+        if (shift > 7u) {
+            throw std::runtime_error("Bad Bit Shift Encountered In Decode.");
+        }
+        UncompressedBuffer.resize(UncompressedBufferSize);
+        if (UncompressedBufferSize == 0) {
+            return Success;
+        }
+
+        {
+            stats::ModelTimer timer(Stats);
+            ProbabilityTable.DecodeFromBuffer(CompressedBuffer, 8);
+            ProbabilityTable.BuildDecodeIndex();
+        }
+        uint32_t denom = ProbabilityTable.GetDenom();
+        uint64_t SymbolCount = UncompressedBufferSize - 1u;
+        if (SymbolCount > 0 && (denom == 0 || (denom&(denom - 1u)) != 0 || denom > (1u<<CarrylessMaxShift))) {
+            throw std::runtime_error("Bad Probability Table Encountered In Decode.");
+        }
+        const uint8_t DenomShift = SymbolCount == 0 ? 0u : uint8_t(__builtin_ctz(denom));
 
-        UncompressedBuffer.TruncateOne();
+        CarrylessDecoder Decoder(CompressedBuffer, 256*4+10);
+        unsigned char* Output = UncompressedBuffer.data();
+        uint32_t pLow, pUp;
+        for (uint64_t i = 0; i < SymbolCount; i++) {
+            uint8_t byte = ProbabilityTable.DecodeSymbol(Decoder.GetCount(DenomShift));
+            std::tie(pLow, pUp, std::ignore) = ProbabilityTable.GetProbability(byte);
+            Decoder.Decode(pLow, pUp);
+            Output[i] = byte;
+        }
+        RestoreShift(UncompressedBuffer, shift, residual_byte);
 
+        if (Stats != nullptr) {
+            Stats->Add(Decoder.Counters());
+        }
         return Success;
     }
 
+    // Adaptive Buffer Compression/Decompression API. The stream is the uint64_t size followed by the coded bits, with
+    // CompressedBuffer created with a base length of 8. Model is any of the models above; the overloads taking one
+    // reset and reuse it, the others construct their own.
+    template<class Model>
+    CodecStatusCode CompressModeled(Model& Coder, buffer::ByteView UncompressedBuffer,
+                                    buffer::CodecByteStream& CompressedBuffer, stats::CoderStats* Stats = nullptr) {
+        RangeEncoder Encoder(CompressedBuffer);
+        Coder.Reset();
+
+        CompressedBuffer.Reserve(8u*UncompressedBuffer.Size() + 64u);
+        for (uint64_t i = 0; i < UncompressedBuffer.Size(); i++) {
+            Coder.Encode(Encoder, UncompressedBuffer[i]);
+        }
+        Encoder.Finish();
+        if (Stats != nullptr) {
+            Stats->Add(Encoder.Counters());
+        }
+
+        uint64_t UncompressedBufferSize = UncompressedBuffer.Size();
+        buffer::EncodeTypeToBuffer<uint64_t>(CompressedBuffer.GetBuffer(), 0, &UncompressedBufferSize);
+        return Success;
+    }
+
+    template<class Model>
+    CodecStatusCode CompressModeled(buffer::ByteView UncompressedBuffer, buffer::CodecByteStream& CompressedBuffer) {
+        std::unique_ptr<Model> model(new Model());
+        return CompressModeled(*model, UncompressedBuffer, CompressedBuffer);
+    }
+
+    template<class Model>
+    CodecStatusCode UncompressModeled(Model& Coder, std::vector<unsigned char>& UncompressedBuffer,
+                                      buffer::ByteView CompressedBuffer, stats::CoderStats* Stats = nullptr) {
+        uint64_t UncompressedBufferSize;
+        if (CompressedBuffer.Size() < 8) {
+            throw std::runtime_error("Truncated Compression Stream.");
+        }
+        buffer::DecodeTypeFromBuffer<uint64_t>(CompressedBuffer, 0, &UncompressedBufferSize);
+
+        RangeDecoder Decoder(CompressedBuffer, 8);
+        Coder.Reset();
+
+        UncompressedBuffer.resize(UncompressedBufferSize);
+        for (uint64_t i = 0; i < UncompressedBufferSize; i++) {
+            UncompressedBuffer[i] = Coder.Decode(Decoder);
+        }
+        if (Stats != nullptr) {
+            Stats->Add(Decoder.Counters());
+        }
+        return Success;
+    }
+
+    template<class Model>
+    CodecStatusCode UncompressModeled(std::vector<unsigned char>& UncompressedBuffer,
+                                      buffer::ByteView CompressedBuffer) {
+        std::unique_ptr<Model> model(new Model());
+        return UncompressModeled(*model, UncompressedBuffer, CompressedBuffer);
+    }
+
     // File Compression/Decompression API
-    CodecStatusCode CompressFile(const std::string& InFile, const std::string& OutFile) {
-        std::vector<unsigned char> UncompressedBuffer;
+    inline CodecStatusCode CompressFile(const std::string& InFile, const std::string& OutFile) {
+        buffer::MappedFile UncompressedFile;
 
-        if (buffer::LoadFile(&InFile, UncompressedBuffer)) {
+        if (buffer::LoadFile(&InFile, UncompressedFile)) {
             buffer::CodecByteStream CompressedBuffer(256*4+8);
-            arith::CompressBuffer(UncompressedBuffer, CompressedBuffer);
+            arith::CompressBuffer(UncompressedFile.View(), CompressedBuffer);
             if (buffer::SaveFile(CompressedBuffer.GetBuffer(), &OutFile)) {
                 return Success;
             } else {
@@ -321,13 +1241,13 @@ namespace arith {
         }
     }
 
-    CodecStatusCode UncompressFile(const std::string& InFile, const std::string& OutFile) {
-        std::vector<unsigned char> CompressedBuffer;
+    inline CodecStatusCode UncompressFile(const std::string& InFile, const std::string& OutFile) {
+        buffer::MappedFile CompressedFile;
 
-        if (buffer::LoadFile(&InFile, CompressedBuffer)) {
+        if (buffer::LoadFile(&InFile, CompressedFile)) {
             buffer::CodecByteStream UncompressedBuffer(0);
             try {
-                arith::UncompressBuffer(UncompressedBuffer, CompressedBuffer);
+                arith::UncompressBuffer(UncompressedBuffer, CompressedFile.View());
             } catch (std::exception& e) {
                 std::cerr << e.what() << std::endl;
                 return BadCompressionStream;
@@ -0,0 +1,484 @@
+#include <atomic>
+#include <cctype>
+#include <fstream>
+#include <new>
+#include <random>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "ans.h"
+#include "arith.h"
+#include "container.h"
+#include "huffman.h"
+#include "library.h"
+
+// Heap allocations made so far, to check that reused contexts stop allocating. The replacements are kept out of line
+// so that the compiler does not see new paired with free where they are inlined into a caller. The array and sized
+// forms forward to these by default.
+std::atomic<uint64_t> Allocations(0);
+
+__attribute__((noinline)) void* operator new(size_t Size) {
+    Allocations++;
+    void* memory = std::malloc(Size == 0 ? 1 : Size);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+__attribute__((noinline)) void operator delete(void* Memory) noexcept {
+    std::free(Memory);
+}
+
+// Text-like data: words drawn from a small skewed vocabulary
+std::vector<unsigned char> GenerateText(uint64_t Size) {
+    const char* words[] = {"the", "of", "and", "a", "to", "in", "is", "you", "that", "it", "he", "was", "for", "on",
+                           "are", "as", "with", "his", "they", "at", "compression", "symbol", "frequency", "buffer"};
+    std::vector<unsigned char> Buffer;
+    Buffer.reserve(Size + 32u);
+    std::mt19937_64 rng(42);
+    std::geometric_distribution<int> pick(0.15);
+
+    while (Buffer.size() < Size) {
+        const char* word = words[pick(rng) % (sizeof(words)/sizeof(words[0]))];
+        Buffer.insert(Buffer.end(), word, word + strlen(word));
+        Buffer.push_back(rng() % 12 == 0 ? '\n' : ' ');
+    }
+    Buffer.resize(Size);
+    return Buffer;
+}
+
+// Peak resident memory since the start or the last ResetPeakResident(), from /proc where it is available
+uint64_t PeakResidentBytes() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return strtoull(line.c_str() + 6, nullptr, 10)*1024u;
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return uint64_t(usage.ru_maxrss)*1024u;
+}
+
+// Restarts the peak at the current resident size. Only Linux supports this; elsewhere the peak stays process-wide.
+void ResetPeakResident() {
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+}
+
+// Time stamp counter ticks, or 0 without one. The counter runs at a fixed rate, so these are cycles at the nominal
+// clock rather than core cycles.
+uint64_t Cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+double Seconds(std::chrono::high_resolution_clock::time_point Start) {
+    return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - Start).count();
+}
+
+// Round trip through one of the ANS variants, reporting size and throughput
+bool BenchAns(const std::vector<unsigned char>& Input, ans::AnsVariant Variant, const char* Name) {
+    auto Start = std::chrono::high_resolution_clock::now();
+    buffer::CodecByteStream CompressedStream(ans::HeaderLength);
+    ans::CompressBuffer(Input, CompressedStream, Variant);
+    double EncodeTime = Seconds(Start);
+
+    std::vector<unsigned char> Output;
+    Start = std::chrono::high_resolution_clock::now();
+    ans::UncompressBuffer(Output, CompressedStream.GetBuffer(), Variant);
+    double DecodeTime = Seconds(Start);
+
+    std::cout << Name << Input.size() << " -> " << CompressedStream.GetBuffer().size() << " Bytes" << std::endl;
+    std::cout << "  encode " << double(Input.size())/EncodeTime/1e6 << " MB/s" << std::endl;
+    std::cout << "  decode " << double(Input.size())/DecodeTime/1e6 << " MB/s" << std::endl;
+    if (Output != Input) {
+        std::cerr << "Round Trip Mismatch." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Time to pick the model from the whole input against from a sample, and what the sample costs in rANS output size
+bool BenchSampling(const std::vector<unsigned char>& Input) {
+    const uint64_t SampleSize = 1ull<<20;
+    for (uint64_t Sample : {uint64_t(0), SampleSize}) {
+        auto Start = std::chrono::high_resolution_clock::now();
+        arith::CodecProbabilityTable ProbabilityTable;
+        ProbabilityTable.GenerateTable(Input, Sample);
+        double ModelTime = Seconds(Start);
+
+        buffer::CodecByteStream CompressedStream(ans::HeaderLength);
+        ans::CompressBuffer(Input, CompressedStream, ans::RansVariant, ans::DefaultLanes, Sample);
+        std::vector<unsigned char> Output;
+        ans::UncompressBuffer(Output, CompressedStream.GetBuffer(), ans::RansVariant);
+
+        std::cout << "model    ";
+        if (Sample == 0) {
+            std::cout << "whole input: ";
+        } else {
+            std::cout << Sample << " Byte sample: ";
+        }
+        std::cout << ModelTime*1e3 << " ms, rans " << CompressedStream.GetBuffer().size() << " Bytes" << std::endl;
+        if (Output != Input) {
+            std::cerr << "Round Trip Mismatch." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Telemetry-like data: 16-bit little-endian samples whose deltas from one to the next are roughly normal
+std::vector<uint16_t> GenerateDeltas(uint64_t Count) {
+    std::vector<uint16_t> Samples(Count);
+    std::mt19937_64 rng(42);
+    std::normal_distribution<double> delta(0.0, 300.0);
+    for (uint64_t i = 0; i < Count; i++) {
+        Samples[i] = uint16_t(int16_t(MAX(MIN(delta(rng), 32767.0), -32768.0)));
+    }
+    return Samples;
+}
+
+// 16-bit deltas coded as bytes and as 16-bit symbols
+bool BenchWideSymbols(uint64_t Size) {
+    std::vector<uint16_t> Samples = GenerateDeltas(Size/2u);
+    buffer::ByteView Bytes(reinterpret_cast<const unsigned char*>(Samples.data()), 2u*Samples.size());
+
+    huffman::HuffmanContext<unsigned char, uint64_t> ByteContext;
+    buffer::CodecByteStream ByteStream(huffman::HeaderLength());
+    auto Start = std::chrono::high_resolution_clock::now();
+    huffman::CompressBuffer(ByteContext, Bytes, ByteStream);
+    double ByteTime = Seconds(Start);
+
+    huffman::HuffmanContext<uint16_t, uint64_t> WideContext;
+    buffer::CodecByteStream WideStream(0);
+    Start = std::chrono::high_resolution_clock::now();
+    huffman::CompressBuffer(WideContext, buffer::BufferView<uint16_t>(Samples), WideStream);
+    double EncodeTime = Seconds(Start);
+
+    std::vector<uint16_t> Output;
+    Start = std::chrono::high_resolution_clock::now();
+    huffman::UncompressBuffer(WideContext, Output, WideStream.GetBuffer());
+    double DecodeTime = Seconds(Start);
+
+    std::cout << "deltas   " << Bytes.Size() << " Bytes: as bytes -> " << ByteStream.GetBuffer().size() << " Bytes at "
+              << double(Bytes.Size())/ByteTime/1e6 << " MB/s, as 16-bit symbols -> " << WideStream.GetBuffer().size()
+              << " Bytes" << std::endl;
+    std::cout << "  encode " << double(Bytes.Size())/EncodeTime/1e6 << " MB/s" << std::endl;
+    std::cout << "  decode " << double(Bytes.Size())/DecodeTime/1e6 << " MB/s" << std::endl;
+    if (Output != Samples) {
+        std::cerr << "Round Trip Mismatch." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Small messages through reused library contexts: messages per second both ways, and heap allocations per message
+// once the contexts are warm
+bool BenchMessages(const std::vector<unsigned char>& Input, container::BlockMethod Method, const char* Name) {
+    const uint64_t MessageSize = 256u;
+    const uint64_t Messages = MIN(Input.size()/MessageSize, 100000ull);
+    if (Messages == 0) {
+        std::cout << Name << "skipped, input shorter than one " << MessageSize << " Byte message" << std::endl;
+        return true;
+    }
+    library::Compressor Compressor(Method);
+    library::Decompressor Decompressor;
+    std::vector<unsigned char> Frame(library::CompressBound(MessageSize));
+    std::vector<unsigned char> Output(MessageSize);
+    uint64_t Written, Restored, FrameBytes = 0, WarmAllocations = 0;
+    double EncodeTime = 0, DecodeTime = 0;
+    bool Matches = true;
+
+    for (uint64_t i = 0; i < Messages; i++) {
+        if (i == Messages/10u) {
+            WarmAllocations = Allocations;
+        }
+        buffer::ByteView Message(Input.data() + i*MessageSize, MessageSize);
+        auto Start = std::chrono::high_resolution_clock::now();
+        Matches &= Compressor.Compress(Message, Frame.data(), Frame.size(), Written) == Success;
+        EncodeTime += Seconds(Start);
+        Start = std::chrono::high_resolution_clock::now();
+        Matches &= Decompressor.Decompress(buffer::ByteView(Frame.data(), Written), Output.data(), Output.size(),
+                                           Restored) == Success;
+        DecodeTime += Seconds(Start);
+        Matches &= Restored == MessageSize && std::equal(Output.begin(), Output.end(), Message.begin());
+        FrameBytes += Written;
+    }
+
+    std::cout << Name << Messages << " x " << MessageSize << " Byte messages -> " << FrameBytes << " Bytes, "
+              << double(Messages)/EncodeTime/1e3 << "k/s encode, " << double(Messages)/DecodeTime/1e3
+              << "k/s decode, " << double(Allocations - WarmAllocations)/double(Messages - Messages/10u)
+              << " allocations per message" << std::endl;
+    if (!Matches) {
+        std::cerr << "Message Round Trip Mismatch." << std::endl;
+    }
+    return Matches;
+}
+
+const uint64_t MaxCorpusSize = 4ull<<20;
+
+// Synthetic corpus, one named data set per kind of input the engines are expected to meet
+std::vector<std::pair<std::string, std::vector<unsigned char>>> GenerateCorpus(uint64_t Size) {
+    std::vector<std::pair<std::string, std::vector<unsigned char>>> Corpus;
+    std::mt19937_64 rng(7);
+
+    Corpus.emplace_back("text", GenerateText(Size));
+    Corpus.emplace_back("zeros", std::vector<unsigned char>(Size, 0u));
+
+    std::vector<unsigned char> Random(Size);
+    for (auto& byte : Random) {
+        byte = uint8_t(rng());
+    }
+    Corpus.emplace_back("random", std::move(Random));
+
+    std::vector<unsigned char> Skewed(Size);
+    std::geometric_distribution<int> skew(0.2);
+    for (auto& byte : Skewed) {
+        byte = uint8_t(MIN(skew(rng), 255));
+    }
+    Corpus.emplace_back("skewed", std::move(Skewed));
+
+    // Fixed-size records as a program would write them: a sequence number, a small type and flag, a noisy reading
+    // and a timestamp that advances with jitter
+    struct Record {
+        uint32_t Sequence;
+        uint16_t Type;
+        uint16_t Flags;
+        float Reading;
+        uint32_t Timestamp;
+    };
+    std::vector<unsigned char> Structs(Size);
+    std::normal_distribution<float> noise(0.0f, 0.5f);
+    Record record = {0u, 0u, 0u, 0.0f, 1600000000u};
+    for (uint64_t offset = 0; offset < Size; offset += sizeof(Record)) {
+        record.Sequence++;
+        record.Type = uint16_t(rng()%4u);
+        record.Flags = uint16_t(rng()%16u == 0u);
+        record.Reading = 20.0f + 5.0f*std::sin(float(record.Sequence)/100.0f) + noise(rng);
+        record.Timestamp += 10u + uint32_t(rng()%3u);
+        memcpy(Structs.data() + offset, &record, MIN(sizeof(Record), Size - offset));
+    }
+    Corpus.emplace_back("structs", std::move(Structs));
+
+    std::vector<uint16_t> Samples = GenerateDeltas((Size + 1u)/2u);
+    const auto* deltas = reinterpret_cast<const unsigned char*>(Samples.data());
+    Corpus.emplace_back("deltas", std::vector<unsigned char>(deltas, deltas + Size));
+    return Corpus;
+}
+
+// Every engine over every data set of the corpus, one block at a time through the container's block coder: encode
+// and decode throughput and time stamp cycles per byte, compression ratio and peak RSS. Prints a table, or a JSON
+// document when Json is set.
+bool BenchCorpus(uint64_t Size, bool Json) {
+    const std::pair<const char*, container::BlockMethod> engines[] = {
+        {"arith", container::ArithMethod}, {"range", container::CarrylessMethod},
+        {"huffman", container::HuffmanMethod}, {"huffman16", container::Huffman16Method},
+        {"rans", container::RansMethod}, {"tans", container::TansMethod},
+        {"adaptive", container::AdaptiveArithMethod}, {"order1", container::Order1ArithMethod},
+        {"order2", container::Order2ArithMethod}, {"mix", container::MixingArithMethod},
+        {"auto", container::AutoMethod}};
+    const uint64_t BlockSize = container::DefaultBlockSize;
+    auto Corpus = GenerateCorpus(Size);
+    bool First = true;
+
+    if (Json) {
+        std::cout << "{\"corpus_bytes\": " << Size << ", \"block_bytes\": " << BlockSize << ", \"results\": [";
+    } else {
+        std::cout << "corpus   " << Size << " Bytes per data set, " << BlockSize << " Byte blocks" << std::endl;
+    }
+    for (auto& data : Corpus) {
+        const std::vector<unsigned char>& Input = data.second;
+        for (auto& engine : engines) {
+            ResetPeakResident();
+            container::BlockCoder Encoder, Decoder;
+            std::vector<std::pair<container::BlockMethod, std::vector<unsigned char>>> Blocks;
+            std::vector<unsigned char> Output;
+            uint64_t CompressedSize = 0, EncodeCycles = 0, DecodeCycles = 0;
+            double EncodeTime = 0, DecodeTime = 0;
+            bool Matches = true;
+
+            for (uint64_t offset = 0; offset < Input.size(); offset += BlockSize) {
+                buffer::ByteView Block(Input.data() + offset, MIN(BlockSize, Input.size() - offset));
+                auto Start = std::chrono::high_resolution_clock::now();
+                uint64_t StartCycles = Cycles();
+                container::BlockMethod used = Encoder.Compress(engine.second, Block);
+                EncodeCycles += Cycles() - StartCycles;
+                EncodeTime += Seconds(Start);
+
+                buffer::ByteView Payload = used == container::StoredMethod ? Block : buffer::ByteView(Encoder.Payload());
+                Blocks.emplace_back(used, std::vector<unsigned char>(Payload.Data(), Payload.Data() + Payload.Size()));
+                CompressedSize += container::BlockHeaderSize + Payload.Size();
+            }
+
+            for (uint64_t i = 0; i < Blocks.size(); i++) {
+                buffer::ByteView Block(Input.data() + i*BlockSize, MIN(BlockSize, Input.size() - i*BlockSize));
+                auto Start = std::chrono::high_resolution_clock::now();
+                uint64_t StartCycles = Cycles();
+                Decoder.Uncompress(Blocks[i].first, Blocks[i].second, uint32_t(Block.Size()), Output);
+                DecodeCycles += Cycles() - StartCycles;
+                DecodeTime += Seconds(Start);
+                Matches &= Output.size() == Block.Size() && std::equal(Output.begin(), Output.end(), Block.Data());
+            }
+            uint64_t PeakBytes = PeakResidentBytes();
+
+            double Ratio = double(Input.size())/double(CompressedSize);
+            double EncodeRate = double(Input.size())/EncodeTime/1e6, DecodeRate = double(Input.size())/DecodeTime/1e6;
+            double EncodePerByte = double(EncodeCycles)/double(Input.size());
+            double DecodePerByte = double(DecodeCycles)/double(Input.size());
+            if (Json) {
+                std::cout << (First ? "\n" : ",\n") << "  {\"engine\": \"" << engine.first << "\", \"dataset\": \""
+                          << data.first << "\", \"input_bytes\": " << Input.size() << ", \"output_bytes\": "
+                          << CompressedSize << ", \"ratio\": " << Ratio << ", \"encode_mb_per_s\": " << EncodeRate
+                          << ", \"decode_mb_per_s\": " << DecodeRate << ", \"encode_cycles_per_byte\": ";
+                if (EncodeCycles == 0) {
+                    std::cout << "null, \"decode_cycles_per_byte\": null";
+                } else {
+                    std::cout << EncodePerByte << ", \"decode_cycles_per_byte\": " << DecodePerByte;
+                }
+                std::cout << ", \"peak_rss_bytes\": " << PeakBytes << ", \"round_trip\": "
+                          << (Matches ? "true" : "false") << "}";
+            } else {
+                std::cout << "  " << std::left << std::setw(8) << data.first << std::setw(10) << engine.first
+                          << std::right << "ratio " << std::setw(7) << Ratio << ", encode " << std::setw(7)
+                          << EncodeRate << " MB/s " << std::setw(6) << EncodePerByte << " cycles/B, decode "
+                          << std::setw(7) << DecodeRate << " MB/s " << std::setw(6) << DecodePerByte
+                          << " cycles/B, peak RSS " << double(PeakBytes)/1e6 << " MB" << std::endl;
+            }
+            First = false;
+            if (!Matches) {
+                std::cerr << "Round Trip Mismatch For " << engine.first << " On " << data.first << "." << std::endl;
+                return false;
+            }
+        }
+    }
+    if (Json) {
+        std::cout << "\n]}" << std::endl;
+    }
+    return true;
+}
+
+// Block-parallel container throughput for 1, 2, 4, ... threads up to the core count
+bool BenchScaling(const std::vector<unsigned char>& Input) {
+    uint64_t Cores = MAX(std::thread::hardware_concurrency(), 1u);
+    std::cout << "scaling  " << Cores << " cores, " << container::DefaultBlockSize << " Byte blocks" << std::endl;
+
+    double BaseTime = 0;
+    for (uint64_t Threads = 1; ; Threads = MIN(2*Threads, Cores)) {
+        std::FILE* Raw = std::tmpfile();
+        std::FILE* Compressed = std::tmpfile();
+        std::FILE* Restored = std::tmpfile();
+        if (Raw == nullptr || Compressed == nullptr || Restored == nullptr ||
+            !container::WriteFull(Raw, Input) || std::fflush(Raw) != 0) {
+            std::cerr << "Could Not Create Temporary Files." << std::endl;
+            return false;
+        }
+        std::rewind(Raw);
+
+        auto Start = std::chrono::high_resolution_clock::now();
+        CodecStatusCode Status = container::CompressStream(container::HuffmanMethod, Raw, Compressed,
+                                                           container::DefaultBlockSize, Threads);
+        double EncodeTime = Seconds(Start);
+
+        std::rewind(Compressed);
+        std::vector<unsigned char> Header;
+        uint32_t BlockSize;
+        Start = std::chrono::high_resolution_clock::now();
+        if (Status == Success) {
+            Status = container::ReadStreamHeader(Compressed, Header, BlockSize) ? Success : BadCompressionStream;
+        }
+        if (Status == Success) {
+            Status = container::UncompressBlocks(Compressed, Restored, BlockSize, Threads);
+        }
+        double DecodeTime = Seconds(Start);
+
+        std::vector<unsigned char> Output(Input.size());
+        std::rewind(Restored);
+        bool Matches = Status == Success && container::ReadFull(Restored, Output.data(), Output.size()) == Output.size()
+                       && Output == Input && std::fgetc(Restored) == EOF;
+        std::fclose(Raw);
+        std::fclose(Compressed);
+        std::fclose(Restored);
+        if (!Matches) {
+            std::cerr << "Round Trip Mismatch With " << Threads << " Threads." << std::endl;
+            return false;
+        }
+
+        BaseTime = Threads == 1 ? EncodeTime + DecodeTime : BaseTime;
+        std::cout << "  " << Threads << " threads: encode " << double(Input.size())/EncodeTime/1e6 << " MB/s, decode "
+                  << double(Input.size())/DecodeTime/1e6 << " MB/s, speedup "
+                  << BaseTime/(EncodeTime + DecodeTime) << "x" << std::endl;
+        if (Threads == Cores) {
+            return true;
+        }
+    }
+}
+
+void print_help() {
+    std::cout << "usage:  bench [--json] [bytes]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t Size = 64ull<<20;
+    bool Json = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            Json = true;
+        } else {
+            char* end = nullptr;
+            Size = strtoull(argv[i], &end, 10);
+            if (!isdigit(static_cast<unsigned char>(argv[i][0])) || *end != '\0' || Size == 0) {
+                print_help();
+                exit(0);
+            }
+        }
+    }
+    if (Json) {
+        std::cout << std::setprecision(4);
+        return BenchCorpus(MIN(Size, MaxCorpusSize), true) ? 0 : 1;
+    }
+    std::vector<unsigned char> Input = GenerateText(Size);
+
+    auto Start = std::chrono::high_resolution_clock::now();
+    buffer::CodecByteStream CompressedStream(huffman::HeaderLength());
+    huffman::CompressBuffer<unsigned char, uint64_t>(Input, CompressedStream);
+    double EncodeTime = Seconds(Start);
+
+    std::vector<unsigned char> Output;
+    Start = std::chrono::high_resolution_clock::now();
+    huffman::UncompressBuffer<unsigned char, uint64_t>(Output, CompressedStream.GetBuffer());
+    double DecodeTime = Seconds(Start);
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "huffman  " << Size << " -> " << CompressedStream.GetBuffer().size() << " Bytes" << std::endl;
+    std::cout << "  encode " << double(Size)/EncodeTime/1e6 << " MB/s" << std::endl;
+    std::cout << "  decode " << double(Size)/DecodeTime/1e6 << " MB/s" << std::endl;
+
+    // Coding may not hold copies of its buffers: peak memory stays within input, compressed and output sizes plus
+    // a fixed allowance for tables and the runtime
+    uint64_t BufferBytes = Input.size() + CompressedStream.GetBuffer().size() + Output.size();
+    uint64_t PeakBytes = PeakResidentBytes();
+    std::cout << "  peak RSS " << double(PeakBytes)/1e6 << " MB for " << double(BufferBytes)/1e6 << " MB of buffers" << std::endl;
+
+    if (Output != Input) {
+        std::cerr << "Round Trip Mismatch." << std::endl;
+        return 1;
+    }
+    if (PeakBytes > BufferBytes + (32ull<<20)) {
+        std::cerr << "Peak Memory Exceeds Buffer Sizes." << std::endl;
+        return 1;
+    }
+    bool passed = BenchAns(Input, ans::RansVariant, "rans     ") && BenchAns(Input, ans::TansVariant, "tans     ") &&
+                  BenchSampling(Input) && BenchWideSymbols(Size) && BenchMessages(Input, container::HuffmanMethod, "messages huffman ") &&
+                  BenchMessages(Input, container::TansMethod, "messages tans    ") &&
+                  BenchMessages(Input, container::AdaptiveArithMethod, "messages adaptive ") &&
+                  BenchMessages(Input, container::AutoMethod, "messages auto    ");
+    return passed && BenchCorpus(MIN(Size, MaxCorpusSize), false) && BenchScaling(Input) ? 0 : 1;
+}
@@ -5,7 +5,16 @@
 #include <cstdint>
 #include <fstream>
 #include <iomanip>
-#include <iterator>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CODEC_POSIX_IO
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // MACRO DEFINITIONS
 #define MIN(x, y) ((x)<=(y)?(x):(y))
@@ -13,39 +22,196 @@
 // END MACRO DEFINITIONS
 
 // ENUM DEFINITIONS
-enum CodecStatusCode {Success, FileReadError, FileWriteError, BadCompressionStream};
+enum CodecStatusCode {Success, FileReadError, FileWriteError, BadCompressionStream, OutputBufferTooSmall, InputTooLarge,
+                      OutOfMemory, CoderError};
 // END ENUM DEFINITIONS
 
 namespace buffer {
-    bool LoadFile(const std::string* path, std::vector<unsigned char>& buffer) {
-        std::ifstream file(path->c_str(), std::fstream::binary);
+    // Non-owning view of a contiguous buffer; the viewed memory must outlive it
+    template<class Type>
+    class BufferView {
+    private:
+        const Type* Pointer = nullptr;
+        uint64_t Length = 0;
+    public:
+        BufferView() {}
+
+        BufferView(const Type* Data, uint64_t Size) : Pointer(Data), Length(Size) {}
+
+        BufferView(const std::vector<Type>& Buffer) : Pointer(Buffer.data()), Length(Buffer.size()) {}
+
+        const Type& operator[](uint64_t Index) const {
+            return Pointer[Index];
+        }
 
-        if (file) {
-            std::noskipws(file);
+        const Type* Data() const {
+            return Pointer;
+        }
+
+        uint64_t Size() const {
+            return Length;
+        }
+
+        BufferView Subview(uint64_t Offset, uint64_t Count) const {
+            return BufferView(Pointer + Offset, Count);
+        }
 
-            file.seekg(0, file.end);
-            uint64_t len = file.tellg();
-            file.seekg(0, file.beg);
+        const Type* begin() const {
+            return Pointer;
+        }
 
-            buffer.resize(len, 0u);
-            std::copy(std::istream_iterator<unsigned char>(file),
-                      std::istream_iterator<unsigned char>(),
-                      &buffer[0]);
+        const Type* end() const {
+            return Pointer + Length;
+        }
+    };
 
-            file.close();
+    typedef BufferView<unsigned char> ByteView;
+
+    const uint64_t IOChunkSize = 8ull<<20;
+
+#ifdef CODEC_POSIX_IO
+    // Read-only contents of a file. Regular files are memory-mapped, anything else (pipes, terminals) is read into
+    // memory in large chunks.
+    class MappedFile {
+    private:
+        void* Mapping = nullptr;
+        uint64_t MappedLength = 0;
+        std::vector<unsigned char> Contents;
+
+        bool ReadStream(int Descriptor) {
+            uint64_t length = 0;
+            while (true) {
+                Contents.resize(length + IOChunkSize);
+                ssize_t count = read(Descriptor, &Contents[length], IOChunkSize);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count < 0) {
+                    return false;
+                }
+                if (count == 0) {
+                    break;
+                }
+                length += uint64_t(count);
+            }
+            Contents.resize(length);
+            Contents.shrink_to_fit();
             return true;
         }
+    public:
+        MappedFile() {}
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            Close();
+        }
 
-        return false;
+        bool Open(int Descriptor) {
+            struct stat info;
+            if (fstat(Descriptor, &info) != 0) {
+                return false;
+            }
+
+            if (S_ISREG(info.st_mode) && info.st_size > 0) {
+                void* mapping = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, Descriptor, 0);
+                if (mapping != MAP_FAILED) {
+                    Mapping = mapping;
+                    MappedLength = uint64_t(info.st_size);
+                    madvise(Mapping, MappedLength, MADV_SEQUENTIAL);
+                    return true;
+                }
+            }
+
+            return ReadStream(Descriptor);
+        }
+
+        ByteView View() const {
+            if (Mapping != nullptr) {
+                return ByteView(static_cast<const unsigned char*>(Mapping), MappedLength);
+            }
+            return ByteView(Contents);
+        }
+
+        void Close() {
+            if (Mapping != nullptr) {
+                munmap(Mapping, MappedLength);
+                Mapping = nullptr;
+                MappedLength = 0;
+            }
+            std::vector<unsigned char>().swap(Contents);
+        }
+    };
+
+    inline bool LoadFile(const std::string* Path, MappedFile& File) {
+        int descriptor = open(Path->c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            return false;
+        }
+        bool loaded = File.Open(descriptor);
+        close(descriptor);
+        return loaded;
+    }
+
+    inline bool WriteAll(int Descriptor, ByteView Buffer) {
+        uint64_t written = 0;
+        while (written < Buffer.Size()) {
+            ssize_t count = write(Descriptor, Buffer.Data() + written, MIN(Buffer.Size() - written, IOChunkSize));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                return false;
+            }
+            written += uint64_t(count);
+        }
+        return true;
+    }
+
+    inline bool SaveFile(ByteView Buffer, const std::string* Path) {
+        int descriptor = open(Path->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (descriptor < 0) {
+            return false;
+        }
+        bool saved = WriteAll(descriptor, Buffer);
+        return close(descriptor) == 0 && saved;
     }
+#else
+    // Without POSIX I/O the file is read into memory in one call
+    class MappedFile {
+    private:
+        std::vector<unsigned char> Contents;
+    public:
+        bool Open(std::ifstream& File) {
+            File.seekg(0, File.end);
+            auto length = uint64_t(File.tellg());
+            File.seekg(0, File.beg);
+            Contents.resize(length);
+            File.read(reinterpret_cast<char*>(Contents.data()), length);
+            return bool(File);
+        }
+
+        ByteView View() const {
+            return ByteView(Contents);
+        }
+
+        void Close() {
+            std::vector<unsigned char>().swap(Contents);
+        }
+    };
 
-    bool SaveFile(const std::vector<unsigned char>& Buffer, const std::string *Path) {
+    inline bool LoadFile(const std::string* Path, MappedFile& File) {
+        std::ifstream file(Path->c_str(), std::fstream::binary);
+        return file && File.Open(file);
+    }
+
+    inline bool SaveFile(ByteView Buffer, const std::string* Path) {
         std::ofstream file(Path->c_str(), std::fstream::binary);
-        std::noskipws(file);
-        file.write(reinterpret_cast<const char *>(&Buffer[0]), Buffer.size());
+        file.write(reinterpret_cast<const char *>(Buffer.Data()), Buffer.Size());
         file.close();
         return file ? true : false;
     }
+#endif
 
     template<class Type>
     void EncodeTypeToBuffer(std::vector<unsigned char>& Buffer, const uint64_t Index, const Type* Value) {
@@ -56,62 +222,115 @@ namespace buffer {
     }
 
     template<class Type>
-    void DecodeTypeFromBuffer(std::vector<unsigned char>& Buffer, const uint64_t Index, Type* DecodedValue) {
+    void DecodeTypeFromBuffer(ByteView Buffer, const uint64_t Index, Type* DecodedValue) {
         auto* byteptr = reinterpret_cast<unsigned char*>(DecodedValue);
         for (uint64_t i = 0; i < sizeof(Type); i++) {
             byteptr[i] = Buffer[Index + i];
         }
     }
 
-    class CodecByteStream {
-    private:
+    inline uint64_t ToBigEndian(uint64_t Word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        return __builtin_bswap64(Word);
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return Word;
+#else
+        uint64_t swapped = 0ull;
+        auto* byteptr = reinterpret_cast<unsigned char*>(&swapped);
+        for (uint8_t i = 0; i < 8u; i++) {
+            byteptr[i] = uint8_t(Word>>(56u-8u*i));
+        }
+        return swapped;
+#endif
+    }
+
+    // Reads the 8 bytes at Bytes as a big-endian word; byte swapping is its own inverse
+    inline uint64_t LoadBigEndian(const unsigned char* Bytes) {
+        uint64_t word;
+        memcpy(&word, Bytes, 8u);
+        return ToBigEndian(word);
+    }
+
+    // Writes MSB-first through a left-aligned 64-bit accumulator. Each flush stores a whole 64-bit word at the current
+    // byte and advances past the completed bytes, so the buffer keeps 8 bytes of slack past the write position.
+    class CodecBitWriter {
+    protected:
         std::vector<unsigned char> Data;
-        uint8_t IBitIndex = 7u;
         uint64_t ByteIndex;
-        int PendingBits = 0;
+        uint64_t BitBuffer = 0ull;
+        uint8_t BitCount = 0u;
+
+        // Reuses capacity left over from a trimming GetBuffer() before reallocating
+        void Grow(uint64_t MinimumSize) {
+            if (MinimumSize <= Data.capacity()) {
+                Data.resize(Data.capacity());
+            } else {
+                Data.resize(MAX(MinimumSize, Data.size() + Data.size()/2u));
+            }
+        }
     public:
-        CodecByteStream(uint64_t BaseLength) {
-            Data.resize(BaseLength+1, 0u);
+        explicit CodecBitWriter(uint64_t BaseLength) {
+            Data.resize(BaseLength+8u, 0u);
             ByteIndex = BaseLength;
         }
 
-        void WriteByte(uint8_t Byte) {
-            Data[ByteIndex] |= Byte>>(7u-IBitIndex);
-            Data.push_back(Byte<<(IBitIndex+1u));
-            ByteIndex++;
+        // Takes over Storage's allocation, leaving Storage empty
+        CodecBitWriter(uint64_t BaseLength, std::vector<unsigned char>& Storage) {
+            Data.swap(Storage);
+            Reset(BaseLength);
         }
 
-        void WriteBit(uint8_t Bit) {
-            Data[ByteIndex] |= Bit<<IBitIndex;
-            if (IBitIndex == 0) {
-                ByteIndex++;
-                Data.push_back(0u);
-                IBitIndex = 7u;
-            } else {
-                IBitIndex--;
+        // Starts a new output after BaseLength zeroed bytes, keeping the allocation of the last one
+        void Reset(uint64_t BaseLength) {
+            Data.resize(BaseLength+8u);
+            std::fill(Data.begin(), Data.end(), 0u);
+            ByteIndex = BaseLength;
+            BitBuffer = 0ull;
+            BitCount = 0u;
+        }
+
+        // Sizes the buffer in advance for Bits more bits so that flushes never reallocate
+        void Reserve(uint64_t Bits) {
+            uint64_t required = ByteIndex + Bits/8u + 16u;
+            if (Data.size() < required) {
+                Data.resize(required);
             }
         }
 
-        void WriteBitBuffered(uint8_t Bit) {
-            WriteBit(Bit);
-            Bit ^= 1u;
-            while (PendingBits > 0) {
-                WriteBit(Bit);
-                PendingBits--;
+        // Appends Length (1 to 56) bits of Code without flushing; the accumulator holds at most 63 bits
+        void Append(uint64_t Code, uint8_t Length) {
+            BitBuffer |= Code<<(64u-BitCount-Length);
+            BitCount += Length;
+        }
+
+        void Flush() {
+            if (ByteIndex + 8u > Data.size()) {
+                Grow(ByteIndex + 8u);
             }
+            uint64_t word = ToBigEndian(BitBuffer);
+            memcpy(&Data[ByteIndex], &word, 8u);
+            ByteIndex += BitCount>>3u;
+            BitBuffer <<= BitCount&~7u;
+            BitCount &= 7u;
         }
 
-        void IncPendingBits() {
-            PendingBits++;
+        void WriteBits(uint64_t Code, uint8_t Length) {
+            Append(Code, Length);
+            Flush();
         }
 
-        void TruncateOne() {
-            Data.resize(Data.size()-1);
-            ByteIndex--;
-            IBitIndex = 7u;
+        void WriteByte(uint8_t Byte) {
+            WriteBits(Byte, 8u);
+        }
+
+        void WriteBit(uint8_t Bit) {
+            WriteBits(Bit, 1u);
         }
 
+        // Flushes any pending bits and trims the buffer to the last written byte
         std::vector<unsigned char>& GetBuffer() {
+            Flush();
+            Data.resize(ByteIndex + (BitCount != 0u ? 1u : 0u));
             return Data;
         }
 
@@ -120,18 +339,52 @@ namespace buffer {
         }
     };
 
+    // Bit writer with the pending-bit handling of the arithmetic coder
+    class CodecByteStream : public CodecBitWriter {
+    private:
+        uint64_t PendingBits = 0;
+    public:
+        explicit CodecByteStream(uint64_t BaseLength) : CodecBitWriter(BaseLength) {}
+        CodecByteStream(uint64_t BaseLength, std::vector<unsigned char>& Storage) : CodecBitWriter(BaseLength, Storage) {}
+
+        void Reset(uint64_t BaseLength) {
+            CodecBitWriter::Reset(BaseLength);
+            PendingBits = 0;
+        }
+
+        // Writes Bit followed by the pending bits, which are all its complement
+        void WriteBitBuffered(uint8_t Bit) {
+            uint8_t run = uint8_t(MIN(PendingBits, 55ull));
+            uint64_t complement = Bit != 0u ? 0ull : (1ull<<run)-1ull;
+            WriteBits((uint64_t(Bit)<<run)|complement, run+1u);
+            PendingBits -= run;
+
+            while (PendingBits > 0) {
+                run = uint8_t(MIN(PendingBits, 56ull));
+                complement = Bit != 0u ? 0ull : ~0ull>>(64u-run);
+                WriteBits(complement, run);
+                PendingBits -= run;
+            }
+        }
+
+        void IncPendingBits(uint64_t Count = 1u) {
+            PendingBits += Count;
+        }
+    };
+
+    // Views the input as bytes realigned by Shift bits, without copying it
     class CodecBufferWrapper {
     private:
-        std::vector<unsigned char> Buffer;
+        ByteView Buffer;
         uint8_t BitShift;
         uint8_t IBitShift;
         uint64_t EffectiveSize;
     public:
-        CodecBufferWrapper(std::vector<unsigned char>& InBuffer, uint8_t Shift) {
+        CodecBufferWrapper(ByteView InBuffer, uint8_t Shift) {
             Buffer = InBuffer;
             BitShift = Shift;
             IBitShift = 8u-Shift;
-            EffectiveSize = Buffer.size() - (Shift == 0 ? 0 : 1); // If a shift is used, the buffer size effectively decreases by one
+            EffectiveSize = Buffer.Size() - (Shift == 0 ? 0 : 1); // If a shift is used, the buffer size effectively decreases by one
         }
 
         uint8_t operator[](uint64_t Index) {
@@ -142,31 +395,112 @@ namespace buffer {
             return EffectiveSize;
         }
 
-        std::vector<unsigned char>& GetBuffer() {
+        ByteView GetBuffer() {
             return Buffer;
         }
     };
 
-    class CodecBitIterator {
+    // Reads the stream MSB-first through a left-aligned 64-bit bit buffer. Bits past the end of the buffer read as zero.
+    class CodecBitReader {
     private:
-        std::vector<unsigned char> Buffer;
+        const unsigned char* Data;
+        uint64_t Size;
         uint64_t ByteIndex;
-        uint64_t BitIndex = 7u;
+        uint64_t BitBuffer = 0ull;
+        uint8_t BitCount = 0u;
     public:
-        CodecBitIterator(std::vector<unsigned char> Buf, uint64_t StartIndex) {
-            Buffer = std::move(Buf);
+        CodecBitReader(ByteView Buf, uint64_t StartIndex) {
+            Data = Buf.Data();
+            Size = Buf.Size();
             ByteIndex = StartIndex;
         }
 
-        uint8_t ReadBit() {
-            uint8_t bit = (Buffer[ByteIndex]>>BitIndex)&1u;
-            if (BitIndex == 0u) {
-                BitIndex = 7u;
+        // Tops the bit buffer up to at least 57 valid bits. Away from the end of the buffer this is one unaligned load:
+        // the whole bytes that fit below the valid bits are taken, and the bits of a partial one are stream bits that
+        // the next refill ORs in again.
+        void Refill() {
+            if (ByteIndex + 8u <= Size) {
+                BitBuffer |= LoadBigEndian(Data + ByteIndex)>>BitCount;
+                ByteIndex += (63u - BitCount)>>3u;
+                BitCount |= 56u;
+                return;
+            }
+            while (BitCount <= 56u) {
+                uint64_t byte = ByteIndex < Size ? Data[ByteIndex] : 0u;
+                BitBuffer |= byte<<(56u-BitCount);
                 ByteIndex++;
-            } else {
-                BitIndex--;
+                BitCount += 8u;
+            }
+        }
+
+        uint64_t Peek(uint8_t Bits) {
+            return BitBuffer>>(64u-Bits);
+        }
+
+        void Consume(uint8_t Bits) {
+            BitBuffer <<= Bits;
+            BitCount -= Bits;
+        }
+
+        uint8_t Available() {
+            return BitCount;
+        }
+    };
+
+    // Reads a stream written MSB-first back to front, last written bits first, through a right-aligned 64-bit bit
+    // buffer. Bits before the start index read as zero.
+    class CodecReverseBitReader {
+    private:
+        const unsigned char* Data;
+        uint64_t StartIndex;
+        uint64_t ByteIndex;
+        uint64_t BitBuffer = 0ull;
+        uint8_t BitCount = 0u;
+        uint64_t ZeroBits = 0u;
+    public:
+        CodecReverseBitReader(ByteView Buf, uint64_t Start) {
+            Data = Buf.Data();
+            StartIndex = Start;
+            ByteIndex = MAX(Buf.Size(), Start);
+        }
+
+        // Tops the bit buffer up to at least 57 valid bits, with one unaligned load away from the start as in
+        // CodecBitReader::Refill
+        void Refill() {
+            if (ByteIndex >= StartIndex + 8u) {
+                BitBuffer |= LoadBigEndian(Data + ByteIndex - 8u)<<BitCount;
+                ByteIndex -= (63u - BitCount)>>3u;
+                BitCount |= 56u;
+                return;
             }
-            return bit;
+            while (BitCount <= 56u) {
+                uint64_t byte = 0u;
+                if (ByteIndex > StartIndex) {
+                    byte = Data[--ByteIndex];
+                } else {
+                    ZeroBits += 8u;
+                }
+                BitBuffer |= byte<<BitCount;
+                BitCount += 8u;
+            }
+        }
+
+        uint64_t Peek(uint8_t Bits) {
+            return BitBuffer&((1ull<<Bits)-1ull);
+        }
+
+        void Consume(uint8_t Bits) {
+            BitBuffer >>= Bits;
+            BitCount -= Bits;
+        }
+
+        uint8_t Available() {
+            return BitCount;
+        }
+
+        // Stream bits not yet consumed; negative once reads have run past the start
+        int64_t Remaining() {
+            return int64_t(8u*(ByteIndex - StartIndex) + BitCount) - int64_t(ZeroBits);
         }
     };
 }
\ No newline at end of file
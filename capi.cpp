@@ -0,0 +1,87 @@
+#include "capi.h"
+#include "library.h"
+
+struct codec_compressor {
+    library::Compressor Context;
+
+    explicit codec_compressor(container::BlockMethod Method) : Context(Method) {}
+};
+
+struct codec_decompressor {
+    library::Decompressor Context;
+};
+
+static void copy_metrics(const container::CodingMetrics& Totals, codec_metrics* metrics) {
+    metrics->messages = Totals.Blocks;
+    metrics->bytes_in = Totals.BytesIn;
+    metrics->bytes_out = Totals.BytesOut;
+    metrics->renormalizations = Totals.Renormalizations;
+    metrics->pending_bit_runs = Totals.PendingBitRuns;
+    metrics->analyze_seconds = Totals.AnalyzeSeconds;
+    metrics->model_seconds = Totals.ModelSeconds;
+    metrics->code_seconds = Totals.CodeSeconds;
+}
+
+size_t codec_compress_bound(size_t size) {
+    return size_t(library::CompressBound(size));
+}
+
+size_t codec_decompressed_size(const void* frame, size_t frame_size) {
+    uint64_t size = library::DecompressedSize(buffer::ByteView(static_cast<const unsigned char*>(frame), frame_size));
+    return size == UINT64_MAX ? size_t(-1) : size_t(size);
+}
+
+codec_compressor* codec_compressor_create(int method) {
+    if ((method < CODEC_METHOD_ARITH || method > CODEC_METHOD_RANGE) && method != CODEC_METHOD_AUTO) {
+        return nullptr;
+    }
+    try {
+        return new codec_compressor(container::BlockMethod(method));
+    } catch (std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void codec_compressor_free(codec_compressor* context) {
+    delete context;
+}
+
+int codec_compress(codec_compressor* context, const void* input, size_t input_size, void* output, size_t capacity,
+                   size_t* written) {
+    uint64_t length;
+    CodecStatusCode status = context->Context.Compress(
+            buffer::ByteView(static_cast<const unsigned char*>(input), input_size),
+            static_cast<unsigned char*>(output), capacity, length);
+    *written = size_t(length);
+    return status;
+}
+
+void codec_compressor_metrics(const codec_compressor* context, codec_metrics* metrics) {
+    copy_metrics(context->Context.Metrics(), metrics);
+}
+
+codec_decompressor* codec_decompressor_create(void) {
+    try {
+        return new codec_decompressor();
+    } catch (std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void codec_decompressor_free(codec_decompressor* context) {
+    delete context;
+}
+
+int codec_decompress(codec_decompressor* context, const void* frame, size_t frame_size, void* output,
+                     size_t capacity, size_t* written) {
+    uint64_t length;
+    CodecStatusCode status = context->Context.Decompress(
+            buffer::ByteView(static_cast<const unsigned char*>(frame), frame_size),
+            static_cast<unsigned char*>(output), capacity, length);
+    *written = size_t(length);
+    return status;
+}
+
+void codec_decompressor_metrics(const codec_decompressor* context, codec_metrics* metrics) {
+    copy_metrics(context->Context.Metrics(), metrics);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+
+/* C interface to the message API in library.h, built into libcodec.a. Frames are interchangeable with the C++
+ * library::Compressor and library::Decompressor. Every function taking a context is safe to call on different
+ * contexts from different threads at once. */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Methods, numbered as container::BlockMethod */
+enum {
+    CODEC_METHOD_ARITH = 1, CODEC_METHOD_HUFFMAN = 2, CODEC_METHOD_RANS = 3, CODEC_METHOD_TANS = 4,
+    CODEC_METHOD_ADAPTIVE = 5, CODEC_METHOD_ORDER1 = 6, CODEC_METHOD_ORDER2 = 7, CODEC_METHOD_MIX = 8,
+    CODEC_METHOD_STORED = 9, CODEC_METHOD_HUFFMAN16 = 10, CODEC_METHOD_RANGE = 11, CODEC_METHOD_AUTO = 255
+};
+
+/* Results, numbered as CodecStatusCode */
+enum {
+    CODEC_SUCCESS = 0, CODEC_FILE_READ_ERROR = 1, CODEC_FILE_WRITE_ERROR = 2, CODEC_BAD_STREAM = 3,
+    CODEC_OUTPUT_TOO_SMALL = 4, CODEC_INPUT_TOO_LARGE = 5, CODEC_OUT_OF_MEMORY = 6, CODEC_CODER_ERROR = 7
+};
+
+typedef struct codec_compressor codec_compressor;
+typedef struct codec_decompressor codec_decompressor;
+
+/* Totals over the messages a context has coded, as container::CodingMetrics. The range coder counters stay zero for
+ * the huffman and ans methods. */
+typedef struct codec_metrics {
+    unsigned long long messages;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long renormalizations;
+    unsigned long long pending_bit_runs;
+    double analyze_seconds;
+    double model_seconds;
+    double code_seconds;
+} codec_metrics;
+
+/* Largest frame codec_compress writes for size input bytes */
+size_t codec_compress_bound(size_t size);
+/* Size a frame decodes to, or (size_t)-1 if it is too short to be one */
+size_t codec_decompressed_size(const void* frame, size_t frame_size);
+
+/* NULL if method is not one of the CODEC_METHOD_ values or memory runs out */
+codec_compressor* codec_compressor_create(int method);
+void codec_compressor_free(codec_compressor* context);
+int codec_compress(codec_compressor* context, const void* input, size_t input_size, void* output, size_t capacity,
+                   size_t* written);
+void codec_compressor_metrics(const codec_compressor* context, codec_metrics* metrics);
+
+codec_decompressor* codec_decompressor_create(void);
+void codec_decompressor_free(codec_decompressor* context);
+int codec_decompress(codec_decompressor* context, const void* frame, size_t frame_size, void* output,
+                     size_t capacity, size_t* written);
+void codec_decompressor_metrics(const codec_decompressor* context, codec_metrics* metrics);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,10 +1,21 @@
-#include "arith.h"
-#include "huffman.h"
+#include "container.h"
 
 const std::string usage("usage:  codec [option] algorithm [option] infile outfile");
-const std::string help0("--algorithm  specify codec algorithm (arith or huffman)");
+const std::string help0("--algorithm  specify codec algorithm (arith, range for a byte-wise arith, adaptive, order1, "
+                         "order2, mix, huffman, huffman16 for 16-bit symbols, ans, tans or auto to pick one per block)");
 const std::string help1("--encode  encode infile to outfile");
 const std::string help2("--decode  decode infile to outfile");
+const std::string help3("--block-size  bytes per independently coded block (default 1048576)");
+const std::string help4("--threads  worker threads coding blocks in parallel, 0 for one per core, at most 256 "
+                         "(default 1)");
+const std::string help5("--sample  estimate the arith, ans and tans models from this many bytes of each block, 0 to read "
+                         "the whole block (default 0)");
+const std::string help6("--tolerance  fraction by which auto may exceed the smallest estimated output to pick a faster "
+                         "algorithm (default 0.05)");
+const std::string help7("--progress  report the blocks coded so far on stderr (quiet by default)");
+const std::string help8("--stats  report time per stage, coder counters and, where perf_event_open allows, hardware "
+                         "counters on stderr");
+const std::string help9("infile or outfile may be - for stdin or stdout");
 
 void print_help() {
     std::cout << usage << std::endl;
@@ -12,31 +23,169 @@ void print_help() {
     std::cout << help0 << std::endl;
     std::cout << help1 << std::endl;
     std::cout << help2 << std::endl;
+    std::cout << help3 << std::endl;
+    std::cout << help4 << std::endl;
+    std::cout << help5 << std::endl;
+    std::cout << help6 << std::endl;
+    std::cout << help7 << std::endl;
+    std::cout << help8 << std::endl;
+    std::cout << help9 << std::endl;
+}
+
+// Rewrites one status line per block, ending with the last block's output size as a fraction of its input
+void print_progress(const container::CodingMetrics& Block, const container::CodingMetrics& Total) {
+    std::cerr << "\33[2K\r" << Total.Blocks << " blocks, " << Total.BytesIn << " -> " << Total.BytesOut << " bytes"
+              << ", last block " << std::fixed << std::setprecision(3)
+              << (Block.BytesIn > 0 ? double(Block.BytesOut)/double(Block.BytesIn) : 0.0) << std::flush;
+}
+
+void print_stage(const char* Name, double Seconds, double Total) {
+    std::cerr << std::left << std::setw(10) << Name << std::right << std::fixed << std::setprecision(4)
+              << std::setw(10) << Seconds << std::setprecision(1) << std::setw(8)
+              << (Total > 0.0 ? 100.0*Seconds/Total : 0.0) << "%" << std::endl;
+}
+
+void print_counter(const char* Name, const stats::HardwareCounters& Counters, stats::HardwareEvent Event,
+                   uint64_t Bytes) {
+    std::cerr << std::left << std::setw(14) << Name << std::right;
+    if (!Counters.Available(Event)) {
+        std::cerr << std::setw(16) << "unavailable" << std::endl;
+        return;
+    }
+    uint64_t count = Counters.Read(Event);
+    std::cerr << std::setw(16) << count << std::fixed << std::setprecision(3) << std::setw(12)
+              << (Bytes > 0 ? double(count)/double(Bytes) : 0.0) << " /byte" << std::endl;
+}
+
+// Stage times are summed over blocks, so with several threads they can add up to more than the wall time
+void print_stats(const container::CodingMetrics& Total, double WallSeconds, const stats::HardwareCounters& Counters) {
+    double stages = Total.ReadSeconds + Total.AnalyzeSeconds + Total.ModelSeconds + Total.CodeSeconds +
+                    Total.WriteSeconds;
+    uint64_t raw = MAX(Total.BytesIn, Total.BytesOut);
+    std::cerr << std::left << std::setw(10) << "stage" << std::right << std::setw(10) << "seconds" << std::setw(9)
+              << "share" << std::endl;
+    print_stage("read", Total.ReadSeconds, stages);
+    print_stage("analyze", Total.AnalyzeSeconds, stages);
+    print_stage("model", Total.ModelSeconds, stages);
+    print_stage("code", Total.CodeSeconds, stages);
+    print_stage("write", Total.WriteSeconds, stages);
+    print_stage("wall", WallSeconds, stages);
+    std::cerr << Total.Blocks << " blocks, " << Total.BytesIn << " -> " << Total.BytesOut << " bytes, "
+              << std::setprecision(2) << (WallSeconds > 0.0 ? double(raw)/WallSeconds/1e6 : 0.0) << " MB/s"
+              << std::endl;
+    std::cerr << Total.Renormalizations << " renormalizations, " << Total.PendingBitRuns << " pending-bit runs"
+              << std::endl;
+    print_counter("cycles", Counters, stats::Cycles, raw);
+    print_counter("instructions", Counters, stats::Instructions, raw);
+    print_counter("branch misses", Counters, stats::BranchMisses, raw);
+    print_counter("L1d misses", Counters, stats::L1DataMisses, raw);
+    print_counter("LLC misses", Counters, stats::LastLevelMisses, raw);
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 6) {
+    const char* algorithm = nullptr;
+    const char* mode = nullptr;
+    std::vector<std::string> files;
+    uint64_t BlockSize = container::DefaultBlockSize;
+    uint64_t Threads = 1;
+    uint64_t SampleSize = 0;
+    double Tolerance = container::DefaultTolerance;
+    bool Progress = false;
+    bool Stats = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--algorithm") == 0 && i + 1 < argc) {
+            algorithm = argv[++i];
+        } else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) {
+            BlockSize = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            Threads = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            SampleSize = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            Tolerance = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--progress") == 0) {
+            Progress = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            Stats = true;
+        } else if (strcmp(argv[i], "--encode") == 0 || strcmp(argv[i], "--decode") == 0) {
+            mode = argv[i];
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+
+    container::BlockMethod method;
+    if (algorithm != nullptr && strcmp(algorithm, "arith") == 0) {
+        method = container::ArithMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "range") == 0) {
+        method = container::CarrylessMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "adaptive") == 0) {
+        method = container::AdaptiveArithMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "order1") == 0) {
+        method = container::Order1ArithMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "order2") == 0) {
+        method = container::Order2ArithMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "mix") == 0) {
+        method = container::MixingArithMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "huffman") == 0) {
+        method = container::HuffmanMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "huffman16") == 0) {
+        method = container::Huffman16Method;
+    } else if (algorithm != nullptr && strcmp(algorithm, "ans") == 0) {
+        method = container::RansMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "tans") == 0) {
+        method = container::TansMethod;
+    } else if (algorithm != nullptr && strcmp(algorithm, "auto") == 0) {
+        method = container::AutoMethod;
+    } else {
         print_help();
-    } else if (strcmp(argv[1], "--algorithm") != 0) {
+        exit(0);
+    }
+
+    if (mode == nullptr || files.size() != 2 ||
+        BlockSize < container::MinBlockSize || BlockSize > container::MaxBlockSize ||
+        Threads > container::MaxThreads) {
         print_help();
-    } else {
-        if (strcmp(argv[3], "--encode") == 0) {
-            if (strcmp(argv[2], "arith") == 0) {
-                arith::CompressFile(std::string(argv[4]), std::string(argv[5]));
-            } else if (strcmp(argv[2], "huffman") == 0) {
-                huffman::CompressFile(std::string(argv[4]), std::string(argv[5]));
-            } else {
-                print_help();
-            }
-        } else {
-            if (strcmp(argv[2], "arith") == 0) {
-                arith::UncompressFile(std::string(argv[4]), std::string(argv[5]));
-            } else if (strcmp(argv[2], "huffman") == 0) {
-                huffman::UncompressFile(std::string(argv[4]), std::string(argv[5]));
-            } else {
-                print_help();
+        exit(0);
+    }
+
+    if (Threads == 0) {
+        Threads = MIN(MAX(std::thread::hardware_concurrency(), 1u), container::MaxThreads);
+    }
+
+    container::CodingMetrics Total;
+    container::ProgressCallback Report;
+    if (Progress || Stats) {
+        Report = [Progress, &Total](const container::CodingMetrics& Block, const container::CodingMetrics& Sum) {
+            Total = Sum;
+            if (Progress) {
+                print_progress(Block, Sum);
             }
-        }
+        };
     }
-    exit(0);
-}
\ No newline at end of file
+
+    // Opened only when asked for, and started before the worker threads so that they inherit the counters
+    std::unique_ptr<stats::HardwareCounters> Counters(Stats ? new stats::HardwareCounters() : nullptr);
+    if (Counters) {
+        Counters->Start();
+    }
+    stats::Clock::time_point start = stats::Clock::now();
+
+    CodecStatusCode status;
+    if (strcmp(mode, "--encode") == 0) {
+        status = container::CompressFile(method, files[0], files[1], uint32_t(BlockSize), Threads, SampleSize, Tolerance,
+                                         Report);
+    } else {
+        status = container::UncompressFile(method, files[0], files[1], Threads, Report);
+    }
+    if (Progress) {
+        std::cerr << std::endl;
+    }
+    if (Counters) {
+        double wall = stats::SecondsSince(start);
+        Counters->Stop();
+        print_stats(Total, wall, *Counters);
+    }
+    exit(status == Success ? 0 : 1);
+}
@@ -0,0 +1,827 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bufferops.h"
+#include "ans.h"
+#include "arith.h"
+#include "huffman.h"
+#include "stats.h"
+#include "threadpool.h"
+
+// Framed stream format. Input is cut into fixed-size blocks that are coded independently, each with its own model
+// header, so a stream can be coded from a pipe with memory bounded by the block size.
+//
+//  Stream header:  Magic[4]  uint8_t FormatVersion  uint32_t BlockSize
+//  Block:          uint8_t Method  uint32_t UncompressedSize  uint32_t CompressedSize  payload
+//  End of stream:  uint8_t EndOfStream
+//
+// A block payload is the output of the method's CompressBuffer for that block, or the block itself when stored.
+// AutoMethod is never written: it picks one of the other methods for each block. Huffman16Method codes the block as
+// little-endian 16-bit symbols, the last one zero-extended when the block has an odd size. CarrylessMethod codes
+// ArithMethod's model with the byte-wise carryless range coder.
+namespace container {
+    enum BlockMethod : uint8_t {EndOfStream = 0u, ArithMethod = 1u, HuffmanMethod = 2u, RansMethod = 3u, TansMethod = 4u,
+                               AdaptiveArithMethod = 5u, Order1ArithMethod = 6u, Order2ArithMethod = 7u,
+                               MixingArithMethod = 8u, StoredMethod = 9u, Huffman16Method = 10u,
+                               CarrylessMethod = 11u, AutoMethod = 255u};
+
+    const unsigned char Magic[4] = {'A', 'R', 'C', 'F'};
+    const uint8_t FormatVersion = 1u;
+    const uint64_t StreamHeaderSize = sizeof(Magic)+sizeof(uint8_t)+sizeof(uint32_t);
+    const uint64_t BlockHeaderSize = sizeof(uint8_t)+2*sizeof(uint32_t);
+    const uint32_t DefaultBlockSize = 1u<<20;
+    const uint32_t MinBlockSize = 1u<<10;
+    const uint32_t MaxBlockSize = 1u<<30;
+    // Most worker threads a stream is coded with; the pipeline holds two blocks in flight for each
+    const uint64_t MaxThreads = 256u;
+
+    // Largest payload a block of BlockSize bytes can produce: the arithmetic coder's header and residual bytes plus
+    // an incompressible body. Anything larger is rejected as corrupt instead of allocated.
+    inline uint64_t MaxPayloadSize(uint32_t BlockSize) {
+        return 2ull*BlockSize + (1ull<<16);
+    }
+
+    inline uint64_t ReadFull(std::FILE* Stream, unsigned char* Buffer, uint64_t Size) {
+        uint64_t total = 0;
+        while (total < Size) {
+            size_t count = std::fread(Buffer + total, 1, MIN(Size - total, buffer::IOChunkSize), Stream);
+            if (count == 0) {
+                break;
+            }
+            total += count;
+        }
+        return total;
+    }
+
+    inline bool WriteFull(std::FILE* Stream, buffer::ByteView Buffer) {
+        return std::fwrite(Buffer.Data(), 1, Buffer.Size(), Stream) == Buffer.Size();
+    }
+
+    // How much larger than the smallest estimate a faster method's output may be for AutoMethod to pick it
+    const double DefaultTolerance = 0.05;
+    // Estimates this close are treated as equal, so that a tiny model header does not decide between near-empty outputs
+    const double ToleranceBytes = 1024.0;
+    // The context models are estimated at this much over the entropy their counts imply, having to learn each pair of
+    // bytes first and adapting more slowly than an ideal model would
+    const double ContextModelOverhead = 1.05;
+    const double PairLearningBytes = 1.5;
+
+    // Picks the method for a block under AutoMethod. Each candidate's output is estimated from the block's pair counts
+    // and the byte counts they fold into: the exact code lengths for huffman, the entropy of the best shift for tans,
+    // and order-0 and order-1 entropies for the adaptive and order-1 coders. The fastest candidate within Tolerance
+    // or ToleranceBytes of the smallest estimate wins, so a block no coder is expected to shrink is stored. rans, range
+    // and arith share tans's model at a lower speed, and order2 and mix cannot be estimated without running them, so
+    // none of those is picked.
+    // Tables ChooseMethod counts into, kept by a caller that picks methods for many blocks so that it does not
+    // allocate them for each one
+    struct ChoiceScratch {
+        std::vector<uint64_t> Pairs;
+        std::vector<uint32_t> PairChunks;
+        uint64_t Tables[256*8];
+        huffman::HuffmanContext<unsigned char, uint64_t> Bytes;
+
+        ChoiceScratch() : Pairs(arith::PairCount) {}
+    };
+
+    inline BlockMethod ChooseMethod(buffer::ByteView Block, ChoiceScratch& Scratch,
+                                    double Tolerance = DefaultTolerance) {
+        std::vector<uint64_t>& pairs = Scratch.Pairs;
+        uint64_t* tables = Scratch.Tables;
+        arith::ComputePairCounts(pairs.data(), Block, Scratch.PairChunks);
+        arith::FoldPairCounts(tables, pairs.data());
+
+        double order0 = arith::EntropyBits(tables, 256)/8.0;
+        double shifted = order0;
+        for (uint16_t shift = 1; shift < 8; shift++) {
+            shifted = MIN(shifted, arith::EntropyBits(&tables[shift*256], 256)/8.0);
+        }
+
+        // The pairs leave out the last byte
+        huffman::HuffmanContext<unsigned char, uint64_t>& bytes = Scratch.Bytes;
+        std::copy(tables, tables + 256, bytes.Counts.begin());
+        if (Block.Size() > 0) {
+            bytes.Counts[Block[Block.Size() - 1]]++;
+        }
+        bytes.ComputeCodeLengths(huffman::MaxCodeLength);
+        uint64_t huffmanBits = 0, used = 0;
+        for (uint16_t i = 0; i < 256; i++) {
+            huffmanBits += bytes.Counts[i]*bytes.CodeLengths[i];
+            used += bytes.Counts[i] != 0;
+        }
+
+        double order1 = 0;
+        uint64_t distinct = 0;
+        for (uint32_t context = 0; context < 256; context++) {
+            order1 += arith::EntropyBits(&pairs[context*256], 256)/8.0;
+        }
+        for (uint32_t p = 0; p < arith::PairCount; p++) {
+            distinct += pairs[p] != 0;
+        }
+
+        const BlockMethod candidates[] = {StoredMethod, HuffmanMethod, TansMethod, AdaptiveArithMethod,
+                                          Order1ArithMethod};
+        const double estimates[] = {double(Block.Size()),
+                                    double(huffman::HeaderLength()) + double(huffmanBits)/8.0,
+                                    double(ans::PayloadOffset) + shifted,
+                                    double(sizeof(uint64_t) + used) + order0,
+                                    double(sizeof(uint64_t)) +
+                                        ContextModelOverhead*MIN(order1 + PairLearningBytes*double(distinct), order0)};
+        double smallest = *std::min_element(estimates, estimates + 5);
+        for (uint8_t i = 0; i < 5; i++) {
+            if (estimates[i] <= smallest*(1.0 + Tolerance) + ToleranceBytes) {
+                return candidates[i];
+            }
+        }
+        return StoredMethod;
+    }
+
+    // Methods coded adaptively through an arith model, with no model header
+    inline bool IsModeled(BlockMethod Method) {
+        return Method >= AdaptiveArithMethod && Method <= MixingArithMethod;
+    }
+
+    // Methods that code each byte independently of the ones before it, and so cannot beat the order-0 entropy
+    inline bool IsOrderZero(BlockMethod Method) {
+        return Method == ArithMethod || Method == HuffmanMethod || Method == RansMethod || Method == TansMethod ||
+               Method == AdaptiveArithMethod || Method == CarrylessMethod;
+    }
+
+    // Bytes looked at by LooksIncompressible, and the fraction of the block an order-0 method must be expected to save
+    // for the block to be coded at all. Blocks below the minimum are coded regardless: the test would cost about as
+    // much as coding them, and the check on the coded size still stores them if they grow.
+    const uint64_t IncompressibleSampleSize = 1ull<<14u;
+    const uint64_t IncompressibleMinimumSize = 1ull<<12u;
+    const double IncompressibleRatio = 0.99;
+
+    // Quick test for already-compressed data ahead of an order-0 method: the entropy of a sample of the block at its
+    // best bit shift
+    inline bool LooksIncompressible(buffer::ByteView Block) {
+        if (Block.Size() < IncompressibleMinimumSize) {
+            return false;
+        }
+        std::vector<unsigned char> sample;
+        if (Block.Size() > IncompressibleSampleSize) {
+            arith::SampleBuffer(Block, IncompressibleSampleSize, sample);
+            Block = buffer::ByteView(sample.data(), sample.size());
+        }
+
+        uint64_t tables[256*8];
+        arith::ComputeProbabilities(tables, Block);
+        double fewest = arith::EntropyBits(tables, 256);
+        for (uint16_t shift = 1; shift < 8; shift++) {
+            fewest = MIN(fewest, arith::EntropyBits(&tables[shift*256], 256));
+        }
+        return fewest/8.0 >= IncompressibleRatio*double(Block.Size());
+    }
+
+    // Size stored in the payload's own header, checked against the frame before the decoder allocates for it. For
+    // Huffman16Method it is the block size rounded up to a whole symbol.
+    inline uint64_t PayloadRawSize(BlockMethod Method, buffer::ByteView Payload) {
+        uint64_t size = UINT64_MAX;
+        if ((Method == ArithMethod || Method == CarrylessMethod || Method == RansMethod || Method == TansMethod ||
+             IsModeled(Method)) && Payload.Size() >= sizeof(uint64_t)) {
+            buffer::DecodeTypeFromBuffer<uint64_t>(Payload, 0, &size);
+        } else if ((Method == HuffmanMethod || Method == Huffman16Method) &&
+                   Payload.Size() >= sizeof(uint16_t)+sizeof(uint64_t)) {
+            buffer::DecodeTypeFromBuffer<uint64_t>(Payload, sizeof(uint16_t), &size);
+            if (Method == Huffman16Method) {
+                size = size > UINT64_MAX/2u ? UINT64_MAX : 2u*size;
+            }
+        } else if (Method == StoredMethod) {
+            size = Payload.Size();
+        }
+        return size;
+    }
+
+    // Counters for one block or a running total over many. Bytes are counted as read and written, block headers
+    // included, so BytesIn is the raw size when compressing and the framed size when decompressing. The range coder
+    // counters stay zero for the huffman and ans methods. Stage times are summed over blocks, and so over threads:
+    // Analyze is picking a method, Model is building or reading a static coder's model, Code is the rest of the
+    // coder's time, and Read and Write are time spent on the streams.
+    struct CodingMetrics {
+        uint64_t Blocks = 0;
+        uint64_t BytesIn = 0;
+        uint64_t BytesOut = 0;
+        uint64_t Renormalizations = 0;
+        uint64_t PendingBitRuns = 0;
+        double AnalyzeSeconds = 0.0;
+        double ModelSeconds = 0.0;
+        double CodeSeconds = 0.0;
+        double ReadSeconds = 0.0;
+        double WriteSeconds = 0.0;
+
+        void Add(const CodingMetrics& Other) {
+            Blocks += Other.Blocks;
+            BytesIn += Other.BytesIn;
+            BytesOut += Other.BytesOut;
+            Renormalizations += Other.Renormalizations;
+            PendingBitRuns += Other.PendingBitRuns;
+            AnalyzeSeconds += Other.AnalyzeSeconds;
+            ModelSeconds += Other.ModelSeconds;
+            CodeSeconds += Other.CodeSeconds;
+            ReadSeconds += Other.ReadSeconds;
+            WriteSeconds += Other.WriteSeconds;
+        }
+    };
+
+    // Called once per block, in stream order, after the block is written, with that block's metrics and the total so
+    // far. An empty callback is the quiet default.
+    typedef std::function<void(const CodingMetrics& Block, const CodingMetrics& Total)> ProgressCallback;
+
+    // Codes blocks one after another, keeping its output buffer, the Huffman tables, the adaptive models and the
+    // tables AutoMethod chooses with between them. Models are created the first time their method is used and reset
+    // for each block after that, so a coder that is reused for blocks of similar size stops allocating for them.
+    class BlockCoder {
+    private:
+        buffer::CodecByteStream Stream;
+        huffman::HuffmanContext<unsigned char, uint64_t> Huffman;
+        std::unique_ptr<huffman::HuffmanContext<uint16_t, uint64_t>> Huffman16;
+        std::vector<uint16_t> Symbols;
+        std::unique_ptr<arith::AdaptiveModel> Adaptive;
+        std::unique_ptr<arith::Order1Model> Order1;
+        std::unique_ptr<arith::Order2Model> Order2;
+        std::unique_ptr<arith::MixingModel> Mixing;
+        std::unique_ptr<ChoiceScratch> Choice;
+        CodingMetrics Metrics;
+
+        template<class Model>
+        static Model& Reuse(std::unique_ptr<Model>& Slot) {
+            if (!Slot) {
+                Slot.reset(new Model());
+            }
+            return *Slot;
+        }
+
+        void ToSymbols(buffer::ByteView Block) {
+            Symbols.resize((Block.Size() + 1u)/2u);
+            for (uint64_t i = 0; i < Block.Size()/2u; i++) {
+                Symbols[i] = uint16_t(Block[2u*i] | Block[2u*i + 1u]<<8u);
+            }
+            if (Block.Size()%2u != 0u) {
+                Symbols.back() = Block[Block.Size() - 1u];
+            }
+        }
+
+        void FromSymbols(uint32_t RawSize, std::vector<unsigned char>& Block) {
+            Block.resize(RawSize);
+            for (uint64_t i = 0; i < RawSize/2u; i++) {
+                Block[2u*i] = uint8_t(Symbols[i]);
+                Block[2u*i + 1u] = uint8_t(Symbols[i]>>8u);
+            }
+            if (RawSize%2u != 0u) {
+                Block[RawSize - 1u] = uint8_t(Symbols.back());
+            }
+        }
+    public:
+        BlockCoder() : Stream(0) {}
+
+        // Codes a block, returning the method it was coded with: Method itself, the one chosen with Tolerance for
+        // AutoMethod, or StoredMethod when the block looks incompressible or its payload would be no smaller than
+        // it. SampleSize is passed on to the static coders, which then estimate their model from a sample. The
+        // payload is the block itself when stored and Payload() otherwise.
+        BlockMethod Compress(BlockMethod Method, buffer::ByteView Block, uint64_t SampleSize = 0,
+                             double Tolerance = DefaultTolerance) {
+            stats::CoderStats coder;
+            Metrics = CodingMetrics();
+            Metrics.Blocks = 1;
+            Metrics.BytesIn = Block.Size();
+            Metrics.BytesOut = BlockHeaderSize + Block.Size();
+
+            stats::Clock::time_point start = stats::Clock::now();
+            if (Method == AutoMethod) {
+                Method = ChooseMethod(Block, Reuse(Choice), Tolerance);
+            } else if (IsOrderZero(Method) && LooksIncompressible(Block)) {
+                Method = StoredMethod;
+            }
+            Metrics.AnalyzeSeconds = stats::SecondsSince(start);
+
+            start = stats::Clock::now();
+            if (Method == StoredMethod) {
+                return Method;
+            } else if (Method == ArithMethod) {
+                Stream.Reset(256*4+8);
+                arith::CompressBuffer(Block, Stream, SampleSize, &coder);
+            } else if (Method == CarrylessMethod) {
+                Stream.Reset(256*4+8);
+                arith::CompressCarryless(Block, Stream, SampleSize, &coder);
+            } else if (IsModeled(Method)) {
+                Stream.Reset(sizeof(uint64_t));
+                if (Method == AdaptiveArithMethod) {
+                    arith::CompressModeled(Reuse(Adaptive), Block, Stream, &coder);
+                } else if (Method == Order1ArithMethod) {
+                    arith::CompressModeled(Reuse(Order1), Block, Stream, &coder);
+                } else if (Method == Order2ArithMethod) {
+                    arith::CompressModeled(Reuse(Order2), Block, Stream, &coder);
+                } else {
+                    arith::CompressModeled(Reuse(Mixing), Block, Stream, &coder);
+                }
+            } else if (Method == RansMethod || Method == TansMethod) {
+                Stream.Reset(ans::HeaderLength);
+                ans::CompressBuffer(Block, Stream, Method == TansMethod ? ans::TansVariant : ans::RansVariant,
+                                    ans::DefaultLanes, SampleSize, &coder);
+            } else if (Method == Huffman16Method) {
+                ToSymbols(Block);
+                huffman::CompressBuffer(Reuse(Huffman16), buffer::BufferView<uint16_t>(Symbols), Stream, 0u, &coder);
+            } else {
+                huffman::CompressBuffer(Huffman, Block, Stream, 0u, &coder);
+            }
+
+            uint64_t size = Stream.GetBuffer().size();
+            Metrics.ModelSeconds = coder.ModelSeconds;
+            Metrics.CodeSeconds = stats::SecondsSince(start) - coder.ModelSeconds;
+            Metrics.Renormalizations = coder.Renormalizations;
+            Metrics.PendingBitRuns = coder.PendingBitRuns;
+            if (size >= Block.Size()) {
+                return StoredMethod;
+            }
+            Metrics.BytesOut = BlockHeaderSize + size;
+            return Method;
+        }
+
+        // The last coded payload, valid until the next call
+        std::vector<unsigned char>& Payload() {
+            return Stream.GetBuffer();
+        }
+
+        // Metrics of the last block coded either way, valid until the next call
+        const CodingMetrics& LastMetrics() const {
+            return Metrics;
+        }
+
+        // Decodes a payload into Block, reusing Block's memory
+        void Uncompress(BlockMethod Method, buffer::ByteView Payload, uint32_t RawSize,
+                        std::vector<unsigned char>& Block) {
+            stats::CoderStats coder;
+            Metrics = CodingMetrics();
+            uint64_t expected = Method == Huffman16Method ? uint64_t(RawSize) + RawSize%2u : RawSize;
+            if (PayloadRawSize(Method, Payload) != expected) {
+                throw std::runtime_error("Block Size Mismatch In Compression Stream.");
+            }
+
+            stats::Clock::time_point start = stats::Clock::now();
+            if (Method == StoredMethod) {
+                Block.assign(Payload.Data(), Payload.Data() + Payload.Size());
+            } else if (Method == ArithMethod) {
+                Stream.Reset(0);
+                arith::UncompressBuffer(Stream, Payload, &coder);
+                Block.swap(Stream.GetBuffer());
+            } else if (Method == CarrylessMethod) {
+                arith::UncompressCarryless(Block, Payload, &coder);
+            } else if (Method == HuffmanMethod) {
+                huffman::UncompressBuffer(Huffman, Block, Payload, &coder);
+            } else if (Method == Huffman16Method) {
+                huffman::UncompressBuffer(Reuse(Huffman16), Symbols, Payload, &coder);
+                FromSymbols(RawSize, Block);
+            } else if (Method == AdaptiveArithMethod) {
+                arith::UncompressModeled(Reuse(Adaptive), Block, Payload, &coder);
+            } else if (Method == Order1ArithMethod) {
+                arith::UncompressModeled(Reuse(Order1), Block, Payload, &coder);
+            } else if (Method == Order2ArithMethod) {
+                arith::UncompressModeled(Reuse(Order2), Block, Payload, &coder);
+            } else if (Method == MixingArithMethod) {
+                arith::UncompressModeled(Reuse(Mixing), Block, Payload, &coder);
+            } else if (Method == RansMethod || Method == TansMethod) {
+                ans::UncompressBuffer(Block, Payload, Method == TansMethod ? ans::TansVariant : ans::RansVariant,
+                                      &coder);
+            }
+
+            Metrics.Blocks = 1;
+            Metrics.BytesIn = BlockHeaderSize + Payload.Size();
+            Metrics.BytesOut = RawSize;
+            Metrics.Renormalizations = coder.Renormalizations;
+            Metrics.PendingBitRuns = coder.PendingBitRuns;
+            Metrics.ModelSeconds = coder.ModelSeconds;
+            Metrics.CodeSeconds = stats::SecondsSince(start) - coder.ModelSeconds;
+        }
+    };
+
+    // Idle coders shared by the jobs of one stream. A job checks a coder out for the block it codes and returns it
+    // afterwards, so a stream allocates at most one coder, with its buffers and models, per block coded at once.
+    class BlockCoderPool {
+    private:
+        std::mutex Lock;
+        std::vector<std::unique_ptr<BlockCoder>> Idle;
+    public:
+        // A coder checked out of a pool, returned to it on destruction
+        class Lease {
+        private:
+            BlockCoderPool& Owner;
+            std::unique_ptr<BlockCoder> Coder;
+        public:
+            explicit Lease(BlockCoderPool& Pool) : Owner(Pool) {
+                {
+                    std::lock_guard<std::mutex> guard(Owner.Lock);
+                    if (!Owner.Idle.empty()) {
+                        Coder = std::move(Owner.Idle.back());
+                        Owner.Idle.pop_back();
+                    }
+                }
+                if (!Coder) {
+                    Coder.reset(new BlockCoder());
+                }
+            }
+
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+
+            // A coder that cannot be put back is freed instead
+            ~Lease() {
+                std::lock_guard<std::mutex> guard(Owner.Lock);
+                try {
+                    Owner.Idle.push_back(std::move(Coder));
+                } catch (std::bad_alloc&) {}
+            }
+
+            BlockCoder* operator->() {
+                return Coder.get();
+            }
+        };
+    };
+
+    inline bool WriteBlock(std::FILE* Output, BlockMethod Method, uint32_t RawSize, buffer::ByteView Payload) {
+        unsigned char BlockHeader[BlockHeaderSize];
+        auto PayloadSize = uint32_t(Payload.Size());
+        BlockHeader[0] = Method;
+        memcpy(BlockHeader + 1, &RawSize, sizeof(uint32_t));
+        memcpy(BlockHeader + 5, &PayloadSize, sizeof(uint32_t));
+        return WriteFull(Output, buffer::ByteView(BlockHeader, BlockHeaderSize)) && WriteFull(Output, Payload);
+    }
+
+    // One block in flight. Input holds the raw block when compressing and the payload when decompressing.
+    struct BlockJob {
+        BlockMethod Method;
+        uint32_t RawSize;
+        std::vector<unsigned char> Input;
+        std::vector<unsigned char> Output;
+        CodingMetrics Metrics;
+        std::promise<void> Done;
+        std::future<void> Ready;
+
+        BlockJob() : Ready(Done.get_future()) {}
+    };
+
+    // Codes blocks on the pool, or inline without one, and hands them back in stream order. The queue of jobs in
+    // flight is the reorder buffer; capping it at two blocks per worker keeps memory bounded.
+    class BlockPipeline {
+    private:
+        parallel::ThreadPool* Pool;
+        std::deque<std::shared_ptr<BlockJob>> InFlight;
+        uint64_t Capacity;
+    public:
+        explicit BlockPipeline(parallel::ThreadPool* WorkerPool) {
+            Pool = WorkerPool;
+            Capacity = Pool != nullptr ? 2u*Pool->Size() : 1u;
+        }
+
+        template<class Work>
+        void Submit(const std::shared_ptr<BlockJob>& Job, Work Code) {
+            auto run = [Job, Code]() {
+                try {
+                    Code(*Job);
+                    Job->Done.set_value();
+                } catch (...) {
+                    Job->Done.set_exception(std::current_exception());
+                }
+            };
+
+            if (Pool != nullptr) {
+                Pool->Submit(run);
+            } else {
+                run();
+            }
+            InFlight.push_back(Job);
+        }
+
+        bool Full() {
+            return InFlight.size() >= Capacity;
+        }
+
+        bool Empty() {
+            return InFlight.empty();
+        }
+
+        // Waits for the oldest block, rethrowing anything its coder threw
+        std::shared_ptr<BlockJob> Next() {
+            std::shared_ptr<BlockJob> Job = InFlight.front();
+            InFlight.pop_front();
+            Job->Ready.get();
+            return Job;
+        }
+    };
+
+    inline std::unique_ptr<parallel::ThreadPool> MakePool(uint64_t Threads) {
+        return std::unique_ptr<parallel::ThreadPool>(Threads > 1 ? new parallel::ThreadPool(Threads) : nullptr);
+    }
+
+    // Adds a block written since WriteStart to Total and reports it to Progress
+    inline void ReportBlock(CodingMetrics& Block, stats::Clock::time_point WriteStart, CodingMetrics& Total,
+                            const ProgressCallback& Progress) {
+        Block.WriteSeconds = stats::SecondsSince(WriteStart);
+        Total.Add(Block);
+        if (Progress) {
+            Progress(Block, Total);
+        }
+    }
+
+    inline CodecStatusCode CompressStream(BlockMethod Method, std::FILE* Input, std::FILE* Output,
+                                          uint32_t BlockSize = DefaultBlockSize, uint64_t Threads = 1,
+                                          uint64_t SampleSize = 0, double Tolerance = DefaultTolerance,
+                                          const ProgressCallback& Progress = ProgressCallback()) {
+        unsigned char StreamHeader[StreamHeaderSize];
+        std::copy(Magic, Magic + sizeof(Magic), StreamHeader);
+        StreamHeader[4] = FormatVersion;
+        memcpy(StreamHeader + 5, &BlockSize, sizeof(uint32_t));
+        if (!WriteFull(Output, buffer::ByteView(StreamHeader, StreamHeaderSize))) {
+            return FileWriteError;
+        }
+
+        // Declared ahead of the thread pool, whose destructor finishes the jobs still holding its coders
+        BlockCoderPool Coders;
+        CodingMetrics Total;
+        bool end = false;
+
+        // Anything a coder throws is rethrown here by Next, and starting the workers or allocating the next block can
+        // fail too
+        try {
+            std::unique_ptr<parallel::ThreadPool> Pool = MakePool(Threads);
+            BlockPipeline Pipeline(Pool.get());
+            while (!end) {
+                auto Job = std::make_shared<BlockJob>();
+                Job->Method = Method;
+                Job->Input.resize(BlockSize);
+                stats::Clock::time_point start = stats::Clock::now();
+                uint64_t count = ReadFull(Input, Job->Input.data(), BlockSize);
+                if (std::ferror(Input)) {
+                    return FileReadError;
+                }
+                Job->Metrics.ReadSeconds = stats::SecondsSince(start);
+                end = count < BlockSize;
+
+                if (count > 0) {
+                    Job->Input.resize(count);
+                    Job->RawSize = uint32_t(count);
+                    Pipeline.Submit(Job, [&Coders, SampleSize, Tolerance](BlockJob& Block) {
+                        BlockCoderPool::Lease Coder(Coders);
+                        Block.Method = Coder->Compress(Block.Method, Block.Input, SampleSize, Tolerance);
+                        if (Block.Method == StoredMethod) {
+                            Block.Output.swap(Block.Input);
+                        } else {
+                            Block.Output = Coder->Payload();
+                        }
+                        Block.Metrics.Add(Coder->LastMetrics());
+                    });
+                }
+
+                while (Pipeline.Full() || (end && !Pipeline.Empty())) {
+                    std::shared_ptr<BlockJob> Done = Pipeline.Next();
+                    stats::Clock::time_point writeStart = stats::Clock::now();
+                    if (!WriteBlock(Output, Done->Method, Done->RawSize, Done->Output)) {
+                        return FileWriteError;
+                    }
+                    ReportBlock(Done->Metrics, writeStart, Total, Progress);
+                }
+            }
+        } catch (std::bad_alloc&) {
+            return OutOfMemory;
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return CoderError;
+        }
+
+        const unsigned char marker = EndOfStream;
+        if (!WriteFull(Output, buffer::ByteView(&marker, 1)) || std::fflush(Output) != 0) {
+            return FileWriteError;
+        }
+        return Success;
+    }
+
+    // Decodes the blocks following a stream header that has already been read.
+    inline CodecStatusCode UncompressBlocks(std::FILE* Input, std::FILE* Output, uint32_t BlockSize, uint64_t Threads = 1,
+                                            const ProgressCallback& Progress = ProgressCallback()) {
+        BlockCoderPool Coders;
+        std::unique_ptr<parallel::ThreadPool> Pool;
+        try {
+            Pool = MakePool(Threads);
+        } catch (std::bad_alloc&) {
+            return OutOfMemory;
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return CoderError;
+        }
+        BlockPipeline Pipeline(Pool.get());
+        unsigned char BlockHeader[BlockHeaderSize];
+        CodingMetrics Total;
+        bool end = false;
+
+        while (!end) {
+            stats::Clock::time_point start = stats::Clock::now();
+            if (ReadFull(Input, BlockHeader, 1) != 1) {
+                return std::ferror(Input) ? FileReadError : BadCompressionStream;
+            }
+            end = BlockHeader[0] == EndOfStream;
+
+            if (!end) {
+                if (ReadFull(Input, BlockHeader + 1, BlockHeaderSize - 1) != BlockHeaderSize - 1) {
+                    return std::ferror(Input) ? FileReadError : BadCompressionStream;
+                }
+
+                auto Job = std::make_shared<BlockJob>();
+                uint32_t PayloadSize;
+                Job->Method = BlockMethod(BlockHeader[0]);
+                memcpy(&Job->RawSize, BlockHeader + 1, sizeof(uint32_t));
+                memcpy(&PayloadSize, BlockHeader + 5, sizeof(uint32_t));
+                if (Job->RawSize > BlockSize || PayloadSize > MaxPayloadSize(BlockSize)) {
+                    return BadCompressionStream;
+                }
+
+                Job->Input.resize(PayloadSize);
+                if (ReadFull(Input, Job->Input.data(), PayloadSize) != PayloadSize) {
+                    return std::ferror(Input) ? FileReadError : BadCompressionStream;
+                }
+                Job->Metrics.ReadSeconds = stats::SecondsSince(start);
+                Pipeline.Submit(Job, [&Coders](BlockJob& Block) {
+                    CodingMetrics metrics;
+                    // A stored block is written straight from the buffer it was read into
+                    if (Block.Method == StoredMethod && Block.Input.size() == Block.RawSize) {
+                        metrics.Blocks = 1;
+                        metrics.BytesIn = BlockHeaderSize + Block.Input.size();
+                        metrics.BytesOut = Block.RawSize;
+                        Block.Output.swap(Block.Input);
+                    } else {
+                        BlockCoderPool::Lease Coder(Coders);
+                        Coder->Uncompress(Block.Method, Block.Input, Block.RawSize, Block.Output);
+                        metrics = Coder->LastMetrics();
+                    }
+                    Block.Metrics.Add(metrics);
+                });
+            }
+
+            while (Pipeline.Full() || (end && !Pipeline.Empty())) {
+                std::shared_ptr<BlockJob> Done;
+                try {
+                    Done = Pipeline.Next();
+                } catch (std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                    return BadCompressionStream;
+                }
+                stats::Clock::time_point writeStart = stats::Clock::now();
+                if (!WriteFull(Output, Done->Output)) {
+                    return FileWriteError;
+                }
+                ReportBlock(Done->Metrics, writeStart, Total, Progress);
+            }
+        }
+
+        return std::fflush(Output) == 0 ? Success : FileWriteError;
+    }
+
+    // Reads and validates a stream header. Returns false, with the bytes read in Header, if it is not one.
+    inline bool ReadStreamHeader(std::FILE* Input, std::vector<unsigned char>& Header, uint32_t& BlockSize) {
+        Header.resize(StreamHeaderSize);
+        Header.resize(ReadFull(Input, Header.data(), StreamHeaderSize));
+        if (Header.size() != StreamHeaderSize || !std::equal(Magic, Magic + sizeof(Magic), Header.begin()) ||
+            Header[4] != FormatVersion) {
+            return false;
+        }
+        memcpy(&BlockSize, &Header[5], sizeof(uint32_t));
+        return BlockSize >= MinBlockSize && BlockSize <= MaxBlockSize;
+    }
+
+    // Path "-" stands for stdin/stdout
+    inline std::FILE* OpenStream(const std::string& Path, const char* Mode) {
+        if (Path == "-") {
+            return Mode[0] == 'r' ? stdin : stdout;
+        }
+        return std::fopen(Path.c_str(), Mode);
+    }
+
+    inline void CloseStream(std::FILE* Stream) {
+        if (Stream != stdin && Stream != stdout) {
+            std::fclose(Stream);
+        }
+    }
+
+    inline CodecStatusCode ReportStatus(CodecStatusCode Status) {
+        if (Status == FileReadError) {
+            std::cerr << "File Read Error." << std::endl;
+        } else if (Status == FileWriteError) {
+            std::cerr << "File Write Error." << std::endl;
+        } else if (Status == BadCompressionStream) {
+            std::cerr << "Bad Compression Stream." << std::endl;
+        } else if (Status == OutOfMemory) {
+            std::cerr << "Out Of Memory." << std::endl;
+        } else if (Status == CoderError) {
+            std::cerr << "Coder Error." << std::endl;
+        }
+        return Status;
+    }
+
+    inline CodecStatusCode CompressFile(BlockMethod Method, const std::string& InFile, const std::string& OutFile,
+                                        uint32_t BlockSize = DefaultBlockSize, uint64_t Threads = 1,
+                                        uint64_t SampleSize = 0, double Tolerance = DefaultTolerance,
+                                        const ProgressCallback& Progress = ProgressCallback()) {
+        std::FILE* Input = OpenStream(InFile, "rb");
+        if (Input == nullptr) {
+            return ReportStatus(FileReadError);
+        }
+        std::FILE* Output = OpenStream(OutFile, "wb");
+        if (Output == nullptr) {
+            CloseStream(Input);
+            return ReportStatus(FileWriteError);
+        }
+
+        CodecStatusCode Status = CompressStream(Method, Input, Output, BlockSize, Threads, SampleSize, Tolerance,
+                                                Progress);
+        CloseStream(Input);
+        CloseStream(Output);
+        return ReportStatus(Status);
+    }
+
+    // Decodes the rest of a stream without the container header, in the method's original whole-buffer format
+    inline CodecStatusCode UncompressLegacy(BlockMethod Method, std::FILE* Input, std::FILE* Output,
+                                            std::vector<unsigned char>& CompressedBuffer,
+                                            const ProgressCallback& Progress = ProgressCallback()) {
+        CodingMetrics metrics, total;
+        stats::Clock::time_point start = stats::Clock::now();
+        uint64_t size = CompressedBuffer.size();
+        do {
+            CompressedBuffer.resize(size + buffer::IOChunkSize);
+            size += ReadFull(Input, CompressedBuffer.data() + size, buffer::IOChunkSize);
+        } while (size == CompressedBuffer.size());
+        CompressedBuffer.resize(size);
+        if (std::ferror(Input)) {
+            return FileReadError;
+        }
+        metrics.ReadSeconds = stats::SecondsSince(start);
+
+        std::vector<unsigned char> UncompressedBuffer;
+        stats::CoderStats coder;
+        start = stats::Clock::now();
+        try {
+            if (Method == ArithMethod) {
+                buffer::CodecByteStream Decoded(0);
+                arith::UncompressBuffer(Decoded, CompressedBuffer, &coder);
+                UncompressedBuffer.swap(Decoded.GetBuffer());
+            } else {
+                huffman::HuffmanContext<unsigned char, uint64_t> Context;
+                huffman::UncompressBuffer(Context, UncompressedBuffer, CompressedBuffer, &coder);
+            }
+        } catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return BadCompressionStream;
+        }
+        metrics.Blocks = 1;
+        metrics.BytesIn = CompressedBuffer.size();
+        metrics.BytesOut = UncompressedBuffer.size();
+        metrics.Renormalizations = coder.Renormalizations;
+        metrics.PendingBitRuns = coder.PendingBitRuns;
+        metrics.ModelSeconds = coder.ModelSeconds;
+        metrics.CodeSeconds = stats::SecondsSince(start) - coder.ModelSeconds;
+
+        start = stats::Clock::now();
+        if (!WriteFull(Output, UncompressedBuffer) || std::fflush(Output) != 0) {
+            return FileWriteError;
+        }
+        ReportBlock(metrics, start, total, Progress);
+        return Success;
+    }
+
+    // Streams without the container header are decoded as LegacyMethod's original format, which is reported to
+    // Progress as a single block
+    inline CodecStatusCode UncompressFile(BlockMethod LegacyMethod, const std::string& InFile, const std::string& OutFile,
+                                          uint64_t Threads = 1, const ProgressCallback& Progress = ProgressCallback()) {
+        std::FILE* Input = OpenStream(InFile, "rb");
+        if (Input == nullptr) {
+            return ReportStatus(FileReadError);
+        }
+        std::FILE* Output = OpenStream(OutFile, "wb");
+        if (Output == nullptr) {
+            CloseStream(Input);
+            return ReportStatus(FileWriteError);
+        }
+
+        CodecStatusCode Status;
+        std::vector<unsigned char> Header;
+        uint32_t BlockSize;
+
+        if (ReadStreamHeader(Input, Header, BlockSize)) {
+            Status = UncompressBlocks(Input, Output, BlockSize, Threads, Progress);
+        } else {
+            Status = UncompressLegacy(LegacyMethod, Input, Output, Header, Progress);
+        }
+
+        CloseStream(Input);
+        CloseStream(Output);
+        return ReportStatus(Status);
+    }
+}
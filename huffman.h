@@ -1,280 +1,714 @@
 #pragma once
 
 #include <iostream>
-#include <queue>
-#include <map>
 #include <algorithm>
-#include <set>
+#include <stdexcept>
+#include <vector>
 
 #include "bufferops.h"
+#include "stats.h"
 
 namespace huffman {
+    // Tree of the original format, which stores symbol frequencies and rebuilds the tree to decode. Nodes live in
+    // one flat array and refer to their children by index, so a tree that is rebuilt reuses its storage.
     template<class SymbolType, class ValueType>
-    class HuffmanNode {
+    class HuffmanTree {
     private:
-        HuffmanNode* nodes[2];
-        bool isRoot;
-        SymbolType sym;
-        ValueType value = 0;
+        struct HuffmanNode {
+            ValueType Value;
+            uint32_t Children[2];
+            SymbolType Symbol;
+            bool IsLeaf;
+        };
+
+        struct PendingNode {
+            uint32_t Node;
+            uint64_t Bits;
+            uint8_t Depth;
+        };
+
+        std::vector<HuffmanNode> Nodes;
+        std::vector<uint32_t> Queue;
+        std::vector<PendingNode> Stack;
+        uint32_t Root = 0;
     public:
-        HuffmanNode (HuffmanNode* x1, HuffmanNode* x2) {
-            nodes[0] = x1;
-            nodes[1] = x2;
-            isRoot = false;
-            value = (*x1)+(*x2);
+        void Clear() {
+            Nodes.clear();
         }
 
-        HuffmanNode (ValueType x1, SymbolType Symbol) {
-            value = x1;
-            isRoot = true;
-            sym = Symbol;
+        // Leaves are added in increasing symbol order
+        void AddLeaf(SymbolType Symbol, ValueType Value) {
+            Nodes.push_back({Value, {0u, 0u}, Symbol, true});
         }
 
-        SymbolType GetSymbol() {
-            return sym;
+        // Merges the leaves into a tree. This replays the original construction step for step, down to the order
+        // std::sort leaves equal weights in, since the codes must match the ones the stream was written with.
+        void Build() {
+            const uint64_t leaves = Nodes.size();
+            if (leaves == 0) {
+                throw std::runtime_error("Bad Symbol Table Encountered In Decode.");
+            }
+            Nodes.reserve(2u*leaves - 1u);
+
+            // Queue[First, Last) is the original deque: leaves and new nodes are pushed at the front, the two
+            // lightest are taken from the back
+            Queue.resize(2u*leaves);
+            uint64_t First = Queue.size(), Last = Queue.size();
+            for (uint64_t i = 0; i < leaves; i++) {
+                Queue[--First] = uint32_t(i);
+            }
+
+            auto Lighter = [this](uint32_t x1, uint32_t x2) { return Nodes[x1].Value < Nodes[x2].Value; };
+            while (Last - First > 1u) {
+                std::sort(std::reverse_iterator<uint32_t*>(Queue.data() + Last),
+                          std::reverse_iterator<uint32_t*>(Queue.data() + First), Lighter);
+                uint32_t x1 = Queue[--Last];
+                uint32_t x2 = Queue[--Last];
+                Nodes.push_back({Nodes[x1].Value + Nodes[x2].Value, {x1, x2}, SymbolType(), false});
+                Queue[--First] = uint32_t(Nodes.size() - 1u);
+            }
+            Root = Queue[First];
         }
 
-        ValueType GetValue() {
-            return value;
+        // Calls Visit(Symbol, Bits, Length) for every leaf, with its code left-aligned in Bits. A tree of one leaf
+        // gives it the code 0.
+        template<class Visitor>
+        void VisitCodes(Visitor Visit) {
+            Stack.clear();
+            Stack.push_back({Root, 0ull, 0u});
+            while (!Stack.empty()) {
+                PendingNode pending = Stack.back();
+                Stack.pop_back();
+                const HuffmanNode& node = Nodes[pending.Node];
+                if (node.IsLeaf) {
+                    Visit(node.Symbol, pending.Bits, uint8_t(MAX(pending.Depth, 1u)));
+                    continue;
+                }
+                if (pending.Depth == 64u) {
+                    throw std::runtime_error("Unsupported Code Length In Decode.");
+                }
+                auto depth = uint8_t(pending.Depth + 1u);
+                Stack.push_back({node.Children[1], pending.Bits | (uint64_t(1)<<(63u - pending.Depth)), depth});
+                Stack.push_back({node.Children[0], pending.Bits, depth});
+            }
         }
+    };
+
+    template<class SymbolType>
+    struct HuffmanDecodeEntry {
+        SymbolType Symbols[2];
+        uint8_t Count = 0;   // symbols decoded by this entry, 0 for a link to a sub-table
+        uint8_t Length = 0;  // bits consumed, or the index width of the linked sub-table
+        uint32_t Link = 0;   // offset of the linked sub-table
+    };
+
+    // Code bits are stored right-aligned and written MSB-first; a Length of 0 marks a symbol without a code
+    struct HuffmanCode {
+        uint32_t Code = 0u;
+        uint8_t Length = 0u;
+    };
+
+    // Multi-level lookup table: a primary table indexed by the next PrimaryBits of the stream, with sub-tables for
+    // codes that do not fit. Primary entries whose bits hold two complete codes decode both symbols at once.
+    template<class SymbolType>
+    class HuffmanDecodeTable {
+    private:
+        // Codes are left-aligned here so that sorting them orders them lexicographically
+        struct AlignedCode {
+            uint64_t Bits;
+            uint8_t Length;
+            SymbolType Symbol;
+
+            bool operator<(const AlignedCode& x) const {
+                return Bits < x.Bits || (Bits == x.Bits && Length < x.Length);
+            }
+        };
+        typedef typename std::vector<AlignedCode>::const_iterator CodeIterator;
+
+        std::vector<HuffmanDecodeEntry<SymbolType>> Entries;
+        std::vector<HuffmanDecodeEntry<SymbolType>> Primary;
+        std::vector<AlignedCode> Codes;
 
-        HuffmanNode* operator[](uint8_t index) {
-            return nodes[index];
+        static uint32_t CodeBits(const AlignedCode& Code, uint32_t Start, uint8_t Bits) {
+            return uint32_t((Code.Bits<<Start)>>(64u-Bits));
         }
 
-        ValueType operator+(HuffmanNode& x) {
-            return value+x.value;
+        // Fills the table at Offset, indexed by Bits code bits after the first Depth bits, which all codes in
+        // [First, Last) share.
+        void FillTable(uint32_t Offset, uint8_t Bits, uint32_t Depth, CodeIterator First, CodeIterator Last) {
+            while (First != Last) {
+                uint32_t index = CodeBits(*First, Depth, Bits);
+
+                if (First->Length <= Depth + Bits) {
+                    HuffmanDecodeEntry<SymbolType> entry;
+                    entry.Symbols[0] = First->Symbol;
+                    entry.Count = 1u;
+                    entry.Length = uint8_t(First->Length - Depth);
+                    std::fill_n(Entries.begin() + Offset + index, 1u << (Depth + Bits - First->Length), entry);
+                    ++First;
+                } else {
+                    // The code set is prefix free and sorted, so every code sharing this prefix is adjacent
+                    CodeIterator GroupEnd = First;
+                    uint32_t MaxLength = 0;
+                    while (GroupEnd != Last && CodeBits(*GroupEnd, Depth, Bits) == index) {
+                        MaxLength = MAX(MaxLength, uint32_t(GroupEnd->Length));
+                        ++GroupEnd;
+                    }
+
+                    auto SubBits = uint8_t(MIN(MaxLength - Depth - Bits, uint32_t(SubTableBits)));
+                    auto SubOffset = uint32_t(Entries.size());
+                    Entries.resize(Entries.size() + (1u << SubBits));
+                    Entries[Offset + index].Length = SubBits;
+                    Entries[Offset + index].Link = SubOffset;
+                    FillTable(SubOffset, SubBits, Depth + Bits, First, GroupEnd);
+                    First = GroupEnd;
+                }
+            }
+        }
+
+        void PairPrimaryEntries() {
+            Primary.assign(Entries.begin(), Entries.begin() + (1u << PrimaryBits));
+            for (uint32_t i = 0; i < Primary.size(); i++) {
+                const HuffmanDecodeEntry<SymbolType>& first = Primary[i];
+                if (first.Count == 1u && first.Length < PrimaryBits) {
+                    const HuffmanDecodeEntry<SymbolType>& second = Primary[(i<<first.Length)&((1u<<PrimaryBits)-1u)];
+                    if (second.Count == 1u && first.Length + second.Length <= PrimaryBits) {
+                        Entries[i].Symbols[1] = second.Symbols[0];
+                        Entries[i].Count = 2u;
+                        Entries[i].Length = first.Length + second.Length;
+                    }
+                }
+            }
+        }
+
+        void BuildEntries() {
+            std::sort(Codes.begin(), Codes.end());
+            Entries.assign(1u << PrimaryBits, HuffmanDecodeEntry<SymbolType>());
+            FillTable(0u, PrimaryBits, 0u, Codes.begin(), Codes.end());
+            PairPrimaryEntries();
         }
+    public:
+        static const uint8_t PrimaryBits = 11u;
+        static const uint8_t SubTableBits = 8u;
+
+        HuffmanDecodeTable() = default;
 
-        bool operator<(HuffmanNode& x) {
-            return value<x.value;
+        explicit HuffmanDecodeTable(const std::vector<HuffmanCode>& CodeTable) {
+            Build(CodeTable);
         }
 
-        bool IsRoot() {
-            return isRoot;
+        // Rebuilds from a code table indexed by symbol, reusing the table's memory
+        void Build(const std::vector<HuffmanCode>& CodeTable) {
+            Codes.clear();
+            for (uint64_t symbol = 0; symbol < CodeTable.size(); symbol++) {
+                const HuffmanCode& code = CodeTable[symbol];
+                if (code.Length != 0u) {
+                    Codes.push_back({uint64_t(code.Code)<<(64u-code.Length), code.Length, SymbolType(symbol)});
+                }
+            }
+            BuildEntries();
         }
 
-        // useful for destructor
-        void SetRoot() {
-            isRoot = true;
+        // Rebuilds from the codes of a tree of the original format, which are not length limited
+        template<class ValueType>
+        void Build(HuffmanTree<SymbolType, ValueType>& Tree) {
+            Codes.clear();
+            Tree.VisitCodes([this](SymbolType Symbol, uint64_t Bits, uint8_t Length) {
+                Codes.push_back({Bits, Length, Symbol});
+            });
+            BuildEntries();
         }
 
-        void FillValues() {
-            if (!isRoot) {
-                nodes[0]->FillValues();
-                nodes[1]->FillValues();
-                value = (*nodes[0])+(*nodes[1]);
+        // Resolves the entry for the next code, consuming its bits.
+        const HuffmanDecodeEntry<SymbolType>& Decode(buffer::CodecBitReader& BitStream) {
+            const HuffmanDecodeEntry<SymbolType>* entry = &Entries[BitStream.Peek(PrimaryBits)];
+            uint8_t width = PrimaryBits;
+
+            while (entry->Count == 0u) {
+                if (entry->Length == 0u) {
+                    throw std::runtime_error("Bad Value Encountered In Decode.");
+                }
+                BitStream.Consume(width);
+                BitStream.Refill();
+                width = entry->Length;
+                entry = &Entries[entry->Link + BitStream.Peek(width)];
             }
+
+            BitStream.Consume(entry->Length);
+            return *entry;
         }
     };
 
-    template<class T>
-    bool ComparePointerObjects(T* x1, T* x2) {return (*x1)<(*x2);};
+    // Stored in the leading uint16_t of a stream. The original format stores its frequency table length there instead,
+    // which is always at least sizeof(uint16_t)+sizeof(uint64_t). The canonical format holds a 4-bit code length for
+    // each of up to 256 symbols; the sparse format, for larger alphabets, lists only the symbols in use.
+    const uint16_t CanonicalFormat = 2u;
+    const uint16_t SparseFormat = 3u;
+    const uint64_t DenseAlphabetSize = 256u;
+    const uint8_t MaxCodeLength = 15u;
+    const uint8_t MaxSparseCodeLength = 24u;
+
+    template<class SymbolType>
+    uint64_t AlphabetSize() {
+        return uint64_t(1)<<(8*sizeof(SymbolType));
+    }
 
+    // Size fields followed by one 4-bit code length per symbol of a dense alphabet
+    inline uint64_t HeaderLength() {
+        return sizeof(uint16_t)+sizeof(uint64_t)+DenseAlphabetSize/2u;
+    }
+
+    // The sparse format follows the size fields with the uint32_t length of the whole header and the uint32_t size of
+    // the alphabet, then runs of code lengths up to the header length: a varint count of unused symbols to skip, a
+    // varint count of symbols in use, and a byte of code length for each of those.
+    const uint64_t SparseRunsOffset = sizeof(uint16_t)+sizeof(uint64_t)+2u*sizeof(uint32_t);
+
+    // Space the original format reserves ahead of the bit stream for the size fields and a full frequency table
     template<class SymbolType, class ValueType>
-    class RootNodeIterator;
+    uint64_t LegacyHeaderLength() {
+        return sizeof(uint16_t)+sizeof(uint64_t)+AlphabetSize<SymbolType>()*(sizeof(SymbolType)+sizeof(ValueType));
+    }
 
+    // Scratch for coding one alphabet: symbol counts, package-merge lists, and the code and decode tables. All of it
+    // is sized by the alphabet or the number of symbols in use, so a context kept between calls codes without
+    // allocating once warm. The alphabet is every value of SymbolType unless Symbols says otherwise, which types wider
+    // than 16 bits need, as do alphabets such as LZ lengths and distances that use only part of their type.
     template<class SymbolType, class ValueType>
-    class HuffmanTree {
+    class HuffmanContext {
     private:
-        HuffmanNode<SymbolType, ValueType>* ParentNode;
-        std::map <SymbolType, std::vector<bool>> SymbolTable;
-        std::vector<HuffmanNode<SymbolType, ValueType>*> AllNodes;
+        std::vector<std::pair<ValueType, SymbolType>> Leaves;
+        std::vector<ValueType> Items;
+        std::vector<ValueType> Merged;
+        std::vector<uint8_t> IsLeaf;
     public:
-        explicit HuffmanTree(const std::map<SymbolType, ValueType>& SortedFrequencyTable) {
-            std::deque<HuffmanNode<SymbolType, ValueType>*> SymbolQueue;
-            HuffmanNode<SymbolType, ValueType>* NodePtr;
+        std::vector<ValueType> Counts;
+        std::vector<uint8_t> CodeLengths;
+        std::vector<HuffmanCode> CodeTable;
+        HuffmanDecodeTable<SymbolType> DecodeTable;
+        HuffmanTree<SymbolType, ValueType> LegacyTree;
+
+        explicit HuffmanContext(uint64_t Symbols = AlphabetSize<SymbolType>()) : Counts(Symbols), CodeLengths(Symbols),
+                                                                                 CodeTable(Symbols) {}
+
+        uint64_t Symbols() const {
+            return Counts.size();
+        }
+
+        void CountSymbols(buffer::BufferView<SymbolType> Buffer) {
+            std::fill(Counts.begin(), Counts.end(), ValueType(0));
+            if (Counts.size() >= AlphabetSize<SymbolType>()) {
+                for (uint64_t i = 0; i < Buffer.Size(); i++) {
+                    Counts[Buffer[i]]++;
+                }
+                return;
+            }
+            for (uint64_t i = 0; i < Buffer.Size(); i++) {
+                if (uint64_t(Buffer[i]) >= Counts.size()) {
+                    throw std::invalid_argument("Symbol Outside The Alphabet.");
+                }
+                Counts[Buffer[i]]++;
+            }
+        }
+
+        // Package-merge: optimal code lengths subject to MaxLength, from Counts into CodeLengths. Each of the
+        // MaxLength-1 rounds pairs up the previous list into packages and merges them with the leaves; the cheapest
+        // 2n-2 items of the final list, expanded back through the rounds, give each symbol one unit of length per
+        // round it is selected in. O(n log n + n MaxLength).
+        void ComputeCodeLengths(uint8_t MaxLength) {
+            std::fill(CodeLengths.begin(), CodeLengths.end(), 0u);
+            Leaves.clear();
+            for (uint64_t symbol = 0; symbol < Counts.size(); symbol++) {
+                if (Counts[symbol] != 0) {
+                    Leaves.push_back(std::make_pair(Counts[symbol], SymbolType(symbol)));
+                }
+            }
+            std::sort(Leaves.begin(), Leaves.end());
 
-            for (auto SymbolFrequency : SortedFrequencyTable) {
-                AllNodes.push_back(new HuffmanNode<SymbolType, ValueType>(std::get<1>(SymbolFrequency), std::get<0>(SymbolFrequency)));
-                SymbolQueue.push_front(AllNodes.back());
+            const uint64_t n = Leaves.size();
+            if (n == 1) {
+                CodeLengths[Leaves[0].second] = 1u;
+            }
+            if (n <= 1) {
+                return;
+            }
+            if (MaxLength == 0u || MaxLength > MaxSparseCodeLength || (uint64_t(1)<<MaxLength) < n) {
+                throw std::invalid_argument("Code Length Limit Cannot Fit The Alphabet.");
             }
 
-            while (SymbolQueue.size() > 1) {
-                std::sort(SymbolQueue.rbegin(), SymbolQueue.rend(), ComparePointerObjects<HuffmanNode<SymbolType, ValueType>>);
-                //std::cout << SymbolQueue.back()->GetValue() << std::endl;
-                NodePtr = SymbolQueue.back();
-                SymbolQueue.pop_back();
-                AllNodes.push_back(new HuffmanNode<SymbolType, ValueType>(NodePtr, SymbolQueue.back()));
-                SymbolQueue.push_front(AllNodes.back());
-                SymbolQueue.pop_back();
+            // No list reaches 2n items, so each round's leaf flags take one row of that width
+            const uint64_t Row = 2u*n;
+            IsLeaf.resize(MaxLength*Row);
+            Items.clear();
+            for (auto& leaf : Leaves) {
+                Items.push_back(leaf.first);
+            }
+            std::fill_n(IsLeaf.begin(), n, 1u);
+
+            for (uint8_t round = 1; round < MaxLength; round++) {
+                uint8_t* flags = &IsLeaf[round*Row];
+                Merged.clear();
+                uint64_t leaf = 0, package = 0;
+                while (leaf < n || package < Items.size()/2u) {
+                    if (package >= Items.size()/2u ||
+                        (leaf < n && Leaves[leaf].first <= Items[2u*package] + Items[2u*package+1u])) {
+                        flags[Merged.size()] = 1u;
+                        Merged.push_back(Leaves[leaf++].first);
+                    } else {
+                        flags[Merged.size()] = 0u;
+                        Merged.push_back(Items[2u*package] + Items[2u*package+1u]);
+                        package++;
+                    }
+                }
+                Items.swap(Merged);
             }
 
-            ParentNode = SymbolQueue[0];
+            uint64_t take = 2u*n - 2u;
+            for (uint8_t round = MaxLength; round-- > 0u;) {
+                uint64_t leaves = 0;
+                for (uint64_t i = 0; i < take; i++) {
+                    leaves += IsLeaf[round*Row + i];
+                }
+                for (uint64_t i = 0; i < leaves; i++) {
+                    CodeLengths[Leaves[i].second]++;
+                }
+                take = 2u*(take - leaves);
+            }
         }
+    };
 
-        void ConstructSymbolTable() {
-            RootNodeIterator<SymbolType, ValueType> RootIterator(this);
-            HuffmanNode<SymbolType, ValueType>* RootNode;
-            do {
-                RootNode = &RootIterator.GetCurrentRootNode();
-                //std::cout << "Symbol: " << (int) RootNode->GetSymbol() << std::endl;
-                SymbolTable[RootNode->GetSymbol()] = RootIterator.GetCurrentIndex();
-            } while (RootIterator++);
+    // Assigns consecutive codes in order of (length, symbol) into CodeTable, one entry per symbol. Throws if the
+    // lengths oversubscribe the code space.
+    inline void CanonicalCodes(const std::vector<uint8_t>& CodeLengths, std::vector<HuffmanCode>& CodeTable) {
+        uint32_t LengthCounts[33] = {0};
+        uint32_t NextCode[33] = {0};
+        uint64_t kraft = 0;
 
+        for (uint8_t length : CodeLengths) {
+            if (length > 32u) {
+                throw std::runtime_error("Bad Code Lengths In Compression Stream.");
+            }
+            if (length != 0u) {
+                LengthCounts[length]++;
+                kraft += uint64_t(1)<<(32u-length);
+            }
+        }
+        if (kraft > (uint64_t(1)<<32u)) {
+            throw std::runtime_error("Bad Code Lengths In Compression Stream.");
         }
 
-        std::map <SymbolType, std::vector<bool>> GetSymbolTable() {
-            return SymbolTable;
+        uint32_t code = 0u;
+        for (uint8_t length = 1; length <= 32u; length++) {
+            code = (code + LengthCounts[length-1u])<<1u;
+            NextCode[length] = code;
         }
 
-        HuffmanNode<SymbolType, ValueType>& operator[](std::vector<bool>& index) {
-            HuffmanNode<SymbolType, ValueType>* ptr = ParentNode;
-            for (auto branch : index) {
-                ptr = (*ptr)[branch];
+        CodeTable.assign(CodeLengths.size(), HuffmanCode());
+        for (uint64_t symbol = 0; symbol < CodeLengths.size(); symbol++) {
+            if (CodeLengths[symbol] != 0u) {
+                CodeTable[symbol].Code = NextCode[CodeLengths[symbol]]++;
+                CodeTable[symbol].Length = CodeLengths[symbol];
             }
-            return (*ptr);
         }
+    }
 
-        ~HuffmanTree() {
-            for (auto ptr: AllNodes) {
-                delete ptr;
-            }
+    inline void EncodeCodeLengths(std::vector<unsigned char>& Buffer, uint64_t Index, const std::vector<uint8_t>& CodeLengths) {
+        std::fill_n(Buffer.begin() + Index, (CodeLengths.size()+1u)/2u, 0u);
+        for (uint64_t symbol = 0; symbol < CodeLengths.size(); symbol++) {
+            Buffer[Index + symbol/2u] |= CodeLengths[symbol]<<(symbol%2u == 0u ? 4u : 0u);
         }
-    };
+    }
 
-    template<class SymbolType, class ValueType>
-    class RootNodeIterator {
-    private:
-        HuffmanTree<SymbolType, ValueType>* Tree;
-        std::vector<bool> Index;
-    public:
-        explicit RootNodeIterator(HuffmanTree<SymbolType, ValueType>* ITree) {
-            Tree = ITree;
-            do {
-                Index.push_back(0);
-            } while (!(*Tree)[Index].IsRoot());
+    inline void DecodeCodeLengths(buffer::ByteView Buffer, uint64_t Index, std::vector<uint8_t>& CodeLengths) {
+        std::fill(CodeLengths.begin(), CodeLengths.end(), 0u);
+        for (uint64_t symbol = 0; symbol < DenseAlphabetSize; symbol++) {
+            uint8_t length = (Buffer[Index + symbol/2u]>>(symbol%2u == 0u ? 4u : 0u))&0xFu;
+            if (symbol < CodeLengths.size()) {
+                CodeLengths[symbol] = length;
+            } else if (length != 0u) {
+                throw std::runtime_error("Unsupported Alphabet Size In Decode.");
+            }
         }
+    }
 
-        HuffmanNode<SymbolType, ValueType>& GetCurrentRootNode() {
-            return (*Tree)[Index];
+    inline uint8_t VarintLength(uint64_t Value) {
+        uint8_t length = 1u;
+        for (; Value >= 0x80u; Value >>= 7u) {
+            length++;
         }
+        return length;
+    }
 
-        std::vector<bool> GetCurrentIndex() {
-            return Index;
+    // LEB128: seven bits per byte, low bits first, the top bit set on all but the last byte
+    inline void EncodeVarint(std::vector<unsigned char>& Buffer, uint64_t& Index, uint64_t Value) {
+        for (; Value >= 0x80u; Value >>= 7u) {
+            Buffer[Index++] = uint8_t(Value|0x80u);
         }
+        Buffer[Index++] = uint8_t(Value);
+    }
 
-        void DumpIndex() {
-            std::cout << "Index: ";
-            for (uint64_t i = 0; i < Index.size(); i++) {
-                std::cout << (int) Index[i];
+    inline uint64_t DecodeVarint(buffer::ByteView Buffer, uint64_t& Index, uint64_t End) {
+        uint64_t value = 0;
+        for (uint8_t shift = 0; shift < 64u; shift += 7u) {
+            if (Index >= End) {
+                throw std::runtime_error("Truncated Compression Stream.");
+            }
+            uint8_t byte = Buffer[Index++];
+            value |= uint64_t(byte&0x7Fu)<<shift;
+            if ((byte&0x80u) == 0u) {
+                return value;
             }
-            std::cout << std::endl << std::flush;
         }
+        throw std::runtime_error("Bad Code Lengths In Compression Stream.");
+    }
 
-        bool operator++(int) {
-            auto LastLeftBranch = std::find(Index.rbegin(), Index.rend(), false);
-            if (LastLeftBranch != Index.rend()) {
-                uint64_t LeftBranch = Index.size()-1ull-(LastLeftBranch-Index.rbegin());
-                Index.resize(LeftBranch+1ull);
-                Index[LeftBranch] = 1;
-                while (!(*Tree)[Index].IsRoot()) {
-                    Index.push_back(0);
-                }
-                //this->DumpIndex();
-                return true;
-            } else {
-                return false;
+    // Length of the sparse header for these code lengths
+    inline uint64_t SparseHeaderLength(const std::vector<uint8_t>& CodeLengths) {
+        uint64_t length = SparseRunsOffset;
+        uint64_t symbol = 0;
+        while (symbol < CodeLengths.size()) {
+            uint64_t skip = symbol;
+            while (skip < CodeLengths.size() && CodeLengths[skip] == 0u) {
+                skip++;
             }
-
+            uint64_t used = skip;
+            while (used < CodeLengths.size() && CodeLengths[used] != 0u) {
+                used++;
+            }
+            if (used == skip) {
+                break;
+            }
+            length += VarintLength(skip - symbol) + VarintLength(used - skip) + (used - skip);
+            symbol = used;
         }
+        return length;
+    }
 
-    };
-
-    struct SetElementComparator {
-        template<typename T>
-        bool operator()(const T& l, const T& r) const
-        {
-            if (l.second != r.second)
-                return l.second < r.second;
-
-            return l.first < r.first;
+    inline void EncodeSparseCodeLengths(std::vector<unsigned char>& Buffer, const std::vector<uint8_t>& CodeLengths) {
+        auto HeaderSize = uint32_t(SparseHeaderLength(CodeLengths));
+        auto Symbols = uint32_t(CodeLengths.size());
+        buffer::EncodeTypeToBuffer<uint32_t>(Buffer, sizeof(uint16_t)+sizeof(uint64_t), &HeaderSize);
+        buffer::EncodeTypeToBuffer<uint32_t>(Buffer, sizeof(uint16_t)+sizeof(uint64_t)+sizeof(uint32_t), &Symbols);
+
+        uint64_t index = SparseRunsOffset;
+        uint64_t symbol = 0;
+        while (index < HeaderSize) {
+            uint64_t skip = symbol;
+            while (CodeLengths[skip] == 0u) {
+                skip++;
+            }
+            uint64_t used = skip;
+            while (used < CodeLengths.size() && CodeLengths[used] != 0u) {
+                used++;
+            }
+            EncodeVarint(Buffer, index, skip - symbol);
+            EncodeVarint(Buffer, index, used - skip);
+            std::copy(CodeLengths.begin() + skip, CodeLengths.begin() + used, Buffer.begin() + index);
+            index += used - skip;
+            symbol = used;
         }
-    };
+    }
 
-    template<class SymbolType, class ValueType>
-    void SortSTLMap(std::map<SymbolType, ValueType>& Table) {
-        std::set<std::pair<SymbolType, ValueType>, SetElementComparator> set(Table.begin(), Table.end());
-        for (auto pair : set) {
-            Table[pair.first] = pair.second;
+    // Reads the sparse header into CodeLengths, which must cover the alphabet it was written with. Returns the header
+    // length.
+    inline uint64_t DecodeSparseCodeLengths(buffer::ByteView Buffer, std::vector<uint8_t>& CodeLengths) {
+        uint32_t HeaderSize, Symbols;
+        if (Buffer.Size() < SparseRunsOffset) {
+            throw std::runtime_error("Truncated Compression Stream.");
+        }
+        buffer::DecodeTypeFromBuffer<uint32_t>(Buffer, sizeof(uint16_t)+sizeof(uint64_t), &HeaderSize);
+        buffer::DecodeTypeFromBuffer<uint32_t>(Buffer, sizeof(uint16_t)+sizeof(uint64_t)+sizeof(uint32_t), &Symbols);
+        if (HeaderSize > Buffer.Size() || HeaderSize < SparseRunsOffset) {
+            throw std::runtime_error("Truncated Compression Stream.");
+        }
+        if (Symbols > CodeLengths.size()) {
+            throw std::runtime_error("Unsupported Alphabet Size In Decode.");
         }
-    }
 
-    template<class SymbolType, class ValueType>
-    void PopulateFrequencyTable(std::map<SymbolType, ValueType>& SortedFrequencyTable, std::vector<SymbolType>& DataBuffer) {
-        for (uint64_t i = 0; i < DataBuffer.size(); i++) {
-            SortedFrequencyTable[DataBuffer[i]]++;
+        std::fill(CodeLengths.begin(), CodeLengths.end(), 0u);
+        uint64_t index = SparseRunsOffset;
+        uint64_t symbol = 0;
+        while (index < HeaderSize) {
+            uint64_t skip = DecodeVarint(Buffer, index, HeaderSize);
+            uint64_t used = DecodeVarint(Buffer, index, HeaderSize);
+            if (skip > Symbols - symbol || used > Symbols - symbol - skip || used > HeaderSize - index) {
+                throw std::runtime_error("Bad Code Lengths In Compression Stream.");
+            }
+            symbol += skip;
+            for (uint64_t i = 0; i < used; i++) {
+                CodeLengths[symbol++] = Buffer[index++];
+            }
         }
-        SortSTLMap(SortedFrequencyTable);
+        return HeaderSize;
     }
 
+    // Buffer Compression/Decompression API. The overloads taking a context reuse its tables, the others construct
+    // their own. Alphabets of up to 256 symbols are written in the canonical format and larger ones in the sparse
+    // format; CompressedBuffer is reset to start after the header. A MaxLength of 0 allows the longest codes the
+    // format does. Stats, when given, is added the time spent building or reading the code.
     template<class SymbolType, class ValueType>
-    void CompressBuffer(std::vector<SymbolType>& UncompressedBuffer, buffer::CodecByteStream& CompressedBuffer) {
-        std::map<SymbolType, ValueType> SortedFrequencyTable;
-        PopulateFrequencyTable(SortedFrequencyTable, UncompressedBuffer);
-        HuffmanTree<SymbolType, ValueType> HuffTree(SortedFrequencyTable);
-        HuffTree.ConstructSymbolTable();
-        auto SymTable = HuffTree.GetSymbolTable();
-        uint64_t index = sizeof(uint16_t)+sizeof(uint64_t);
-        for (auto keyval : SortedFrequencyTable) {
-            buffer::EncodeTypeToBuffer<SymbolType>(CompressedBuffer.GetBuffer(), index, &keyval.first);
-            index += sizeof(SymbolType);
-            buffer::EncodeTypeToBuffer<ValueType>(CompressedBuffer.GetBuffer(), index, &keyval.second);
-            index += sizeof(ValueType);
+    void CompressBuffer(HuffmanContext<SymbolType, ValueType>& Context,
+                        buffer::BufferView<SymbolType> UncompressedBuffer,
+                        buffer::CodecByteStream& CompressedBuffer,
+                        uint8_t MaxLength = 0u,
+                        stats::CoderStats* Stats = nullptr) {
+        const bool Dense = Context.Symbols() <= DenseAlphabetSize;
+        const uint8_t Limit = Dense ? MaxCodeLength : MaxSparseCodeLength;
+        if (MaxLength > Limit) {
+            throw std::invalid_argument("Code Length Limit Exceeds The Format.");
         }
-        auto ushrt = uint16_t(index);
-        buffer::EncodeTypeToBuffer<uint16_t>(CompressedBuffer.GetBuffer(), 0, &ushrt);
-        auto ull = uint64_t(UncompressedBuffer.size());
+        {
+            stats::ModelTimer timer(Stats);
+            Context.CountSymbols(UncompressedBuffer);
+            Context.ComputeCodeLengths(MaxLength == 0u ? Limit : MaxLength);
+            CanonicalCodes(Context.CodeLengths, Context.CodeTable);
+        }
+        const std::vector<uint8_t>& CodeLengths = Context.CodeLengths;
+        const std::vector<HuffmanCode>& CodeTable = Context.CodeTable;
+
+        CompressedBuffer.Reset(Dense ? HeaderLength() : SparseHeaderLength(CodeLengths));
+        buffer::EncodeTypeToBuffer<uint16_t>(CompressedBuffer.GetBuffer(), 0, Dense ? &CanonicalFormat : &SparseFormat);
+        auto ull = uint64_t(UncompressedBuffer.Size());
         buffer::EncodeTypeToBuffer<uint64_t>(CompressedBuffer.GetBuffer(), sizeof(uint16_t), &ull);
+        if (Dense) {
+            EncodeCodeLengths(CompressedBuffer.GetBuffer(), sizeof(uint16_t)+sizeof(uint64_t), CodeLengths);
+        } else {
+            EncodeSparseCodeLengths(CompressedBuffer.GetBuffer(), CodeLengths);
+        }
 
-        std::vector<bool> code;
-        for (SymbolType symbol : UncompressedBuffer) {
-            code = SymTable[symbol];
-            for (bool bit : code) {
-                CompressedBuffer.WriteBit(bit);
+        uint64_t StreamBits = 0;
+        for (uint64_t symbol = 0; symbol < Context.Counts.size(); symbol++) {
+            StreamBits += uint64_t(Context.Counts[symbol])*CodeTable[symbol].Length;
+        }
+        CompressedBuffer.Reserve(StreamBits);
+
+        // Three codes of at most 18 bits fit in the accumulator alongside the up to 7 bits left by a flush, and two of
+        // any length the sparse format allows
+        const SymbolType* symbol = UncompressedBuffer.Data();
+        const SymbolType* end = symbol + UncompressedBuffer.Size();
+        if (!CodeLengths.empty() && *std::max_element(CodeLengths.begin(), CodeLengths.end()) > 18u) {
+            for (; end - symbol >= 2; symbol += 2) {
+                CompressedBuffer.Append(CodeTable[symbol[0]].Code, CodeTable[symbol[0]].Length);
+                CompressedBuffer.Append(CodeTable[symbol[1]].Code, CodeTable[symbol[1]].Length);
+                CompressedBuffer.Flush();
             }
         }
+        for (; end - symbol >= 3; symbol += 3) {
+            CompressedBuffer.Append(CodeTable[symbol[0]].Code, CodeTable[symbol[0]].Length);
+            CompressedBuffer.Append(CodeTable[symbol[1]].Code, CodeTable[symbol[1]].Length);
+            CompressedBuffer.Append(CodeTable[symbol[2]].Code, CodeTable[symbol[2]].Length);
+            CompressedBuffer.Flush();
+        }
+        for (; symbol < end; symbol++) {
+            CompressedBuffer.WriteBits(CodeTable[*symbol].Code, CodeTable[*symbol].Length);
+        }
     }
 
     template<class SymbolType, class ValueType>
-    void UncompressBuffer(std::vector<SymbolType>& UncompressedBuffer, std::vector<unsigned char>& CompressedBuffer) {
-        std::map<SymbolType, ValueType> SortedFrequencyTable;
-        uint16_t mindex;
-        uint64_t UncompressedSize;
-        buffer::DecodeTypeFromBuffer<uint16_t>(CompressedBuffer, 0, &mindex);
-        buffer::DecodeTypeFromBuffer<uint64_t>(CompressedBuffer, sizeof(uint16_t), &UncompressedSize);
+    void CompressBuffer(buffer::BufferView<SymbolType> UncompressedBuffer,
+                        buffer::CodecByteStream& CompressedBuffer,
+                        uint8_t MaxLength = 0u) {
+        HuffmanContext<SymbolType, ValueType> Context;
+        CompressBuffer(Context, UncompressedBuffer, CompressedBuffer, MaxLength);
+    }
+
+    // Rebuilds the tree of the original format from its stored frequency table, which ends at TableEnd
+    template<class SymbolType, class ValueType>
+    void DecodeLegacyTree(HuffmanTree<SymbolType, ValueType>& Tree, buffer::ByteView CompressedBuffer,
+                          uint16_t TableEnd) {
         uint16_t index = sizeof(uint16_t)+sizeof(uint64_t);
-        SymbolType key;
+        SymbolType key, previous = 0;
         ValueType val;
 
-        while (index < mindex) {
+        Tree.Clear();
+        while (index < TableEnd) {
             buffer::DecodeTypeFromBuffer<SymbolType>(CompressedBuffer, index, &key);
             index += sizeof(SymbolType);
             buffer::DecodeTypeFromBuffer<ValueType>(CompressedBuffer, index, &val);
             index += sizeof(ValueType);
-            SortedFrequencyTable[key] = val;
+            // The table was written from a map, in increasing symbol order
+            if (index > sizeof(uint16_t)+sizeof(uint64_t)+sizeof(SymbolType)+sizeof(ValueType) && key <= previous) {
+                throw std::runtime_error("Bad Symbol Table Encountered In Decode.");
+            }
+            Tree.AddLeaf(key, val);
+            previous = key;
         }
+        Tree.Build();
+    }
+
+    template<class SymbolType, class ValueType>
+    void UncompressBuffer(HuffmanContext<SymbolType, ValueType>& Context,
+                          std::vector<SymbolType>& UncompressedBuffer,
+                          buffer::ByteView CompressedBuffer,
+                          stats::CoderStats* Stats = nullptr) {
+        HuffmanDecodeTable<SymbolType>& DecodeTable = Context.DecodeTable;
+        uint16_t format;
+        uint64_t UncompressedSize;
+        uint64_t StreamStart;
 
-        HuffmanTree<SymbolType, ValueType> HuffTree(SortedFrequencyTable);
+        if (CompressedBuffer.Size() < sizeof(uint16_t)+sizeof(uint64_t)) {
+            throw std::runtime_error("Truncated Compression Stream.");
+        }
+        buffer::DecodeTypeFromBuffer<uint16_t>(CompressedBuffer, 0, &format);
+        buffer::DecodeTypeFromBuffer<uint64_t>(CompressedBuffer, sizeof(uint16_t), &UncompressedSize);
 
-        buffer::CodecBitIterator BitStream(CompressedBuffer, index);
-        std::vector<bool> TreeIndex;
+        {
+            stats::ModelTimer timer(Stats);
+            if (format == CanonicalFormat || format == SparseFormat) {
+                if (format == CanonicalFormat) {
+                    StreamStart = HeaderLength();
+                    if (CompressedBuffer.Size() < StreamStart) {
+                        throw std::runtime_error("Truncated Compression Stream.");
+                    }
+                    DecodeCodeLengths(CompressedBuffer, sizeof(uint16_t)+sizeof(uint64_t), Context.CodeLengths);
+                } else {
+                    StreamStart = DecodeSparseCodeLengths(CompressedBuffer, Context.CodeLengths);
+                }
+                CanonicalCodes(Context.CodeLengths, Context.CodeTable);
+                DecodeTable.Build(Context.CodeTable);
+            } else {
+                StreamStart = LegacyHeaderLength<SymbolType, ValueType>();
+                if (CompressedBuffer.Size() < StreamStart) {
+                    throw std::runtime_error("Truncated Compression Stream.");
+                }
+                if (format > StreamStart || format <= sizeof(uint16_t)+sizeof(uint64_t) ||
+                    (format - sizeof(uint16_t) - sizeof(uint64_t))%(sizeof(SymbolType)+sizeof(ValueType)) != 0) {
+                    throw std::runtime_error("Bad Symbol Table Encountered In Decode.");
+                }
+                DecodeLegacyTree(Context.LegacyTree, CompressedBuffer, format);
+                DecodeTable.Build(Context.LegacyTree);
+            }
+        }
 
-        while (UncompressedBuffer.size() < UncompressedSize) {
-            TreeIndex.push_back(BitStream.ReadBit());
-            if (HuffTree[TreeIndex].IsRoot()) {
-                UncompressedBuffer.push_back(HuffTree[TreeIndex].GetSymbol());
-                TreeIndex.resize(0);
+        buffer::CodecBitReader BitStream(CompressedBuffer, StreamStart);
+        UncompressedBuffer.resize(UncompressedSize);
+        SymbolType* Output = UncompressedBuffer.data();
+        SymbolType* OutputEnd = Output + UncompressedSize;
+
+        while (Output < OutputEnd) {
+            BitStream.Refill();
+            // A refill leaves at least 57 bits, enough for several primary lookups
+            while (BitStream.Available() >= HuffmanDecodeTable<SymbolType>::PrimaryBits && Output < OutputEnd) {
+                const HuffmanDecodeEntry<SymbolType>& entry = DecodeTable.Decode(BitStream);
+                *Output++ = entry.Symbols[0];
+                if (entry.Count == 2u && Output < OutputEnd) {
+                    *Output++ = entry.Symbols[1];
+                }
             }
         }
     }
 
-    CodecStatusCode CompressFile(const std::string& InFile, const std::string& OutFile) {
-        std::vector<unsigned char> UncompressedBuffer;
+    template<class SymbolType, class ValueType>
+    void UncompressBuffer(std::vector<SymbolType>& UncompressedBuffer, buffer::ByteView CompressedBuffer) {
+        HuffmanContext<SymbolType, ValueType> Context;
+        UncompressBuffer(Context, UncompressedBuffer, CompressedBuffer);
+    }
+
+    inline CodecStatusCode CompressFile(const std::string& InFile, const std::string& OutFile) {
+        buffer::MappedFile UncompressedFile;
 
-        if (buffer::LoadFile(&InFile, UncompressedBuffer)) {
-            buffer::CodecByteStream CompressedBuffer(2+8+256*(1+8));
-            CompressBuffer<unsigned char, uint64_t>(UncompressedBuffer, CompressedBuffer);
+        if (buffer::LoadFile(&InFile, UncompressedFile)) {
+            buffer::CodecByteStream CompressedBuffer(HeaderLength());
+            CompressBuffer<unsigned char, uint64_t>(UncompressedFile.View(), CompressedBuffer);
             if (buffer::SaveFile(CompressedBuffer.GetBuffer(), &OutFile)) {
                 return Success;
             } else {
@@ -287,13 +721,13 @@ namespace huffman {
         }
     }
 
-    CodecStatusCode UncompressFile(const std::string& InFile, const std::string& OutFile) {
-        std::vector<unsigned char> CompressedBuffer;
+    inline CodecStatusCode UncompressFile(const std::string& InFile, const std::string& OutFile) {
+        buffer::MappedFile CompressedFile;
         std::vector<unsigned char> UncompressedBuffer;
 
-        if (buffer::LoadFile(&InFile, CompressedBuffer)) {
+        if (buffer::LoadFile(&InFile, CompressedFile)) {
             try {
-                UncompressBuffer<unsigned char, uint64_t>(UncompressedBuffer, CompressedBuffer);
+                UncompressBuffer<unsigned char, uint64_t>(UncompressedBuffer, CompressedFile.View());
             } catch (std::exception& e) {
                 std::cerr << e.what() << std::endl;
                 return BadCompressionStream;
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "container.h"
+
+// Message API for embedding the coders. Each call codes one buffer into a self-contained frame laid out like a
+// container block,
+//
+//  uint8_t Method  uint32_t UncompressedSize  uint32_t CompressedSize  payload
+//
+// written into memory the caller provides. Contexts hold their output buffers and models between calls, so a context
+// reused for messages of similar size stops allocating after the first few; nothing is printed or read from files.
+// Each context also totals container::CodingMetrics over the messages it has coded, for monitoring.
+namespace library {
+    const uint64_t FrameHeaderSize = container::BlockHeaderSize;
+    const uint64_t MaxMessageSize = container::MaxBlockSize;
+
+    // Largest frame Compress writes for Size input bytes. Messages that would grow are stored, so this is exact.
+    inline uint64_t CompressBound(uint64_t Size) {
+        return FrameHeaderSize + Size;
+    }
+
+    // Size a frame decodes to, or UINT64_MAX if Frame is too short to hold a header
+    inline uint64_t DecompressedSize(buffer::ByteView Frame) {
+        uint32_t size;
+        if (Frame.Size() < FrameHeaderSize) {
+            return UINT64_MAX;
+        }
+        memcpy(&size, Frame.Data() + 1, sizeof(uint32_t));
+        return size;
+    }
+
+    class Compressor {
+    private:
+        container::BlockCoder Coder;
+        container::BlockMethod Method;
+        uint64_t SampleSize;
+        double Tolerance;
+        container::CodingMetrics Totals;
+    public:
+        explicit Compressor(container::BlockMethod CodingMethod, uint64_t Sample = 0,
+                            double AutoTolerance = container::DefaultTolerance) {
+            Method = CodingMethod;
+            SampleSize = Sample;
+            Tolerance = AutoTolerance;
+        }
+
+        // Writes the frame for Input to Output, which holds Capacity bytes, and its length to Written. Capacity of
+        // CompressBound(Input.Size()) always suffices.
+        CodecStatusCode Compress(buffer::ByteView Input, unsigned char* Output, uint64_t Capacity, uint64_t& Written) {
+            Written = 0;
+            if (Input.Size() > MaxMessageSize) {
+                return InputTooLarge;
+            }
+
+            container::BlockMethod used;
+            try {
+                used = Coder.Compress(Method, Input, SampleSize, Tolerance);
+            } catch (std::bad_alloc&) {
+                return OutOfMemory;
+            } catch (std::exception&) {
+                return CoderError;
+            }
+
+            buffer::ByteView Payload = used == container::StoredMethod ? Input : buffer::ByteView(Coder.Payload());
+            if (FrameHeaderSize + Payload.Size() > Capacity) {
+                return OutputBufferTooSmall;
+            }
+
+            auto RawSize = uint32_t(Input.Size());
+            auto PayloadSize = uint32_t(Payload.Size());
+            Output[0] = used;
+            memcpy(Output + 1, &RawSize, sizeof(uint32_t));
+            memcpy(Output + 5, &PayloadSize, sizeof(uint32_t));
+            if (Payload.Size() > 0) {
+                memcpy(Output + FrameHeaderSize, Payload.Data(), Payload.Size());
+            }
+            Written = FrameHeaderSize + Payload.Size();
+            Totals.Add(Coder.LastMetrics());
+            return Success;
+        }
+
+        // Totals over the messages compressed so far
+        const container::CodingMetrics& Metrics() const {
+            return Totals;
+        }
+    };
+
+    class Decompressor {
+    private:
+        container::BlockCoder Coder;
+        std::vector<unsigned char> Decoded;
+        container::CodingMetrics Totals;
+    public:
+        // Decodes one frame into Output, which holds Capacity bytes, and writes its length to Written. Capacity of
+        // DecompressedSize(Frame) suffices.
+        CodecStatusCode Decompress(buffer::ByteView Frame, unsigned char* Output, uint64_t Capacity,
+                                   uint64_t& Written) {
+            Written = 0;
+            uint64_t RawSize = DecompressedSize(Frame);
+            uint32_t PayloadSize;
+            if (RawSize == UINT64_MAX) {
+                return BadCompressionStream;
+            }
+            memcpy(&PayloadSize, Frame.Data() + 5, sizeof(uint32_t));
+            if (PayloadSize != Frame.Size() - FrameHeaderSize) {
+                return BadCompressionStream;
+            }
+            if (RawSize > Capacity) {
+                return OutputBufferTooSmall;
+            }
+
+            auto Method = container::BlockMethod(Frame[0]);
+            buffer::ByteView Payload = Frame.Subview(FrameHeaderSize, PayloadSize);
+            if (Method == container::StoredMethod) {
+                if (PayloadSize != RawSize) {
+                    return BadCompressionStream;
+                }
+                if (RawSize > 0) {
+                    memcpy(Output, Payload.Data(), RawSize);
+                }
+                container::CodingMetrics stored;
+                stored.Blocks = 1;
+                stored.BytesIn = Frame.Size();
+                stored.BytesOut = RawSize;
+                Totals.Add(stored);
+                Written = RawSize;
+                return Success;
+            }
+
+            try {
+                Coder.Uncompress(Method, Payload, uint32_t(RawSize), Decoded);
+            } catch (std::bad_alloc&) {
+                return OutOfMemory;
+            } catch (std::exception&) {
+                return BadCompressionStream;
+            }
+            if (RawSize > 0) {
+                memcpy(Output, Decoded.data(), RawSize);
+            }
+            Totals.Add(Coder.LastMetrics());
+            Written = RawSize;
+            return Success;
+        }
+
+        // Totals over the frames decompressed so far
+        const container::CodingMetrics& Metrics() const {
+            return Totals;
+        }
+    };
+}
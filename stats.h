@@ -0,0 +1,156 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#define CODEC_PERF_EVENTS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Instrumentation shared by the coders and the container. Timers are read once per buffer or block, never per symbol.
+namespace stats {
+    typedef std::chrono::steady_clock Clock;
+
+    inline double SecondsSince(Clock::time_point Start) {
+        return std::chrono::duration<double>(Clock::now() - Start).count();
+    }
+
+    // Work done by one coder call. ModelSeconds is the time spent counting symbols and building or reading the
+    // model's tables, apart from the coding loop. Renormalizations counts the bits the range coder shifted out of (or
+    // into) its interval, and PendingBitRuns the runs of undecided bits it deferred around the midpoint; both stay
+    // zero for the huffman and ans coders, and the carryless coder never defers bits.
+    struct CoderStats {
+        double ModelSeconds = 0.0;
+        uint64_t Renormalizations = 0;
+        uint64_t PendingBitRuns = 0;
+
+        void Add(const CoderStats& Other) {
+            ModelSeconds += Other.ModelSeconds;
+            Renormalizations += Other.Renormalizations;
+            PendingBitRuns += Other.PendingBitRuns;
+        }
+    };
+
+    // Adds the time from construction to destruction to Stats->ModelSeconds, if Stats is given
+    class ModelTimer {
+    private:
+        CoderStats* Stats;
+        Clock::time_point Start;
+    public:
+        explicit ModelTimer(CoderStats* Target) : Stats(Target) {
+            if (Stats != nullptr) {
+                Start = Clock::now();
+            }
+        }
+
+        ModelTimer(const ModelTimer&) = delete;
+        ModelTimer& operator=(const ModelTimer&) = delete;
+
+        ~ModelTimer() {
+            if (Stats != nullptr) {
+                Stats->ModelSeconds += SecondsSince(Start);
+            }
+        }
+    };
+
+    enum HardwareEvent {Cycles, Instructions, BranchMisses, L1DataMisses, LastLevelMisses, HardwareEventCount};
+
+    // Hardware counters for the calling thread and the threads it starts afterwards, read through perf_event_open.
+    // Counters the kernel or the machine does not provide, or that perf_event_paranoid forbids, are unavailable and
+    // read as zero. When there are more events than hardware counters the kernel multiplexes them and the counts
+    // are scaled up from the time each was running.
+    class HardwareCounters {
+    private:
+        int Descriptors[HardwareEventCount];
+
+#ifdef CODEC_PERF_EVENTS
+        static int Open(uint32_t Type, uint64_t Config) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = Type;
+            attr.config = Config;
+            attr.disabled = 1;
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            return int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+
+        static uint64_t CacheMisses(uint64_t Cache) {
+            return Cache | (PERF_COUNT_HW_CACHE_OP_READ<<8u) | (PERF_COUNT_HW_CACHE_RESULT_MISS<<16u);
+        }
+#endif
+    public:
+        HardwareCounters() {
+            for (int& descriptor : Descriptors) {
+                descriptor = -1;
+            }
+#ifdef CODEC_PERF_EVENTS
+            Descriptors[Cycles] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            Descriptors[Instructions] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+            Descriptors[BranchMisses] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+            Descriptors[L1DataMisses] = Open(PERF_TYPE_HW_CACHE, CacheMisses(PERF_COUNT_HW_CACHE_L1D));
+            Descriptors[LastLevelMisses] = Open(PERF_TYPE_HW_CACHE, CacheMisses(PERF_COUNT_HW_CACHE_LL));
+#endif
+        }
+
+        HardwareCounters(const HardwareCounters&) = delete;
+        HardwareCounters& operator=(const HardwareCounters&) = delete;
+
+        ~HardwareCounters() {
+#ifdef CODEC_PERF_EVENTS
+            for (int descriptor : Descriptors) {
+                if (descriptor >= 0) {
+                    close(descriptor);
+                }
+            }
+#endif
+        }
+
+        bool Available(HardwareEvent Event) const {
+            return Descriptors[Event] >= 0;
+        }
+
+        void Start() {
+#ifdef CODEC_PERF_EVENTS
+            for (int descriptor : Descriptors) {
+                if (descriptor >= 0) {
+                    ioctl(descriptor, PERF_EVENT_IOC_RESET, 0);
+                    ioctl(descriptor, PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+#endif
+        }
+
+        void Stop() {
+#ifdef CODEC_PERF_EVENTS
+            for (int descriptor : Descriptors) {
+                if (descriptor >= 0) {
+                    ioctl(descriptor, PERF_EVENT_IOC_DISABLE, 0);
+                }
+            }
+#endif
+        }
+
+        // Threads started after Start are included once they have exited
+        uint64_t Read(HardwareEvent Event) const {
+#ifdef CODEC_PERF_EVENTS
+            uint64_t values[3];
+            if (Descriptors[Event] < 0 || read(Descriptors[Event], values, sizeof(values)) != sizeof(values) ||
+                values[2] == 0) {
+                return 0;
+            }
+            return values[2] == values[1] ? values[0] : uint64_t(double(values[0])*double(values[1])/double(values[2]));
+#else
+            return 0;
+#endif
+        }
+    };
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace parallel {
+    // Work-stealing pool. Submitted tasks are dealt round-robin onto per-worker queues; a worker runs its own queue
+    // newest-first and, once that is empty, steals the oldest task from another worker's queue.
+    class ThreadPool {
+    private:
+        typedef std::function<void()> Task;
+
+        struct WorkerQueue {
+            std::mutex Lock;
+            std::deque<Task> Tasks;
+        };
+
+        std::vector<std::unique_ptr<WorkerQueue>> Queues;
+        std::vector<std::thread> Workers;
+        std::mutex SleepLock;
+        std::condition_variable WakeUp;
+        std::atomic<uint64_t> Pending;
+        std::atomic<uint64_t> NextQueue;
+        bool Stopping = false;
+
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> guard(SleepLock);
+                Stopping = true;
+            }
+            WakeUp.notify_all();
+            for (auto& worker : Workers) {
+                worker.join();
+            }
+        }
+
+        bool TryPop(uint64_t Index, Task& Work) {
+            WorkerQueue& queue = *Queues[Index];
+            std::lock_guard<std::mutex> guard(queue.Lock);
+            if (queue.Tasks.empty()) {
+                return false;
+            }
+            Work = std::move(queue.Tasks.back());
+            queue.Tasks.pop_back();
+            return true;
+        }
+
+        bool TrySteal(uint64_t Index, Task& Work) {
+            for (uint64_t i = 1; i < Queues.size(); i++) {
+                WorkerQueue& queue = *Queues[(Index + i) % Queues.size()];
+                std::lock_guard<std::mutex> guard(queue.Lock);
+                if (!queue.Tasks.empty()) {
+                    Work = std::move(queue.Tasks.front());
+                    queue.Tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void WorkerLoop(uint64_t Index) {
+            while (true) {
+                Task Work;
+                if (TryPop(Index, Work) || TrySteal(Index, Work)) {
+                    Pending--;
+                    Work();
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(SleepLock);
+                WakeUp.wait(lock, [this] { return Stopping || Pending > 0; });
+                if (Stopping && Pending == 0) {
+                    return;
+                }
+            }
+        }
+    public:
+        explicit ThreadPool(uint64_t Threads) : Pending(0), NextQueue(0) {
+            Threads = Threads == 0 ? 1 : Threads;
+            for (uint64_t i = 0; i < Threads; i++) {
+                Queues.emplace_back(new WorkerQueue());
+            }
+            // A thread that fails to start leaves the ones already running to be stopped before the failure is passed on
+            try {
+                for (uint64_t i = 0; i < Threads; i++) {
+                    Workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+                }
+            } catch (...) {
+                Stop();
+                throw;
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        void Submit(Task Work) {
+            WorkerQueue& queue = *Queues[NextQueue++ % Queues.size()];
+            {
+                std::lock_guard<std::mutex> guard(SleepLock);
+                Pending++;
+            }
+            {
+                std::lock_guard<std::mutex> guard(queue.Lock);
+                queue.Tasks.push_back(std::move(Work));
+            }
+            WakeUp.notify_one();
+        }
+
+        uint64_t Size() {
+            return Workers.size();
+        }
+
+        // Finishes every submitted task before joining the workers
+        ~ThreadPool() {
+            Stop();
+        }
+    };
+}